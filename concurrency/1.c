@@ -1,13 +1,25 @@
+#define _GNU_SOURCE              // pthread_setaffinity_np
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <time.h>
-#include <semaphore.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sched.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
-#define MAX_FILES 10
-#define MAX_USERS 100
+#define CACHE_LINE 64
 #define YELLOW "\033[1;33m"
 #define PINK "\033[1;35m"
 #define WHITE "\033[1;37m"
@@ -15,185 +27,3479 @@
 #define RED "\033[1;31m"
 #define RESET "\033[0m"
 
-// Operation times
-int read_time, write_time, delete_time;
+// Execution engines: one sleeping thread per request, or an event-driven
+// dispatcher feeding a fixed pool of workers. Override with -DENGINE=...
+#define ENGINE_THREADS 0
+#define ENGINE_DISPATCHER 1
+#ifndef ENGINE
+#define ENGINE ENGINE_DISPATCHER
+#endif
+#ifndef NUM_WORKERS
+#define NUM_WORKERS 4
+#endif
+// How due events reach the worker pool: one shared FIFO, or per-worker
+// work-stealing deques with each file homed on one worker
+#define EXECUTOR_SHARED 0
+#define EXECUTOR_STEALING 1
+#ifndef EXECUTOR
+#define EXECUTOR EXECUTOR_SHARED
+#endif
+// Dispatcher: instead of the shared worker pool, partition files over
+// NUM_SHARDS shards, each with its own event queue and one pinned thread
+#ifndef NUM_SHARDS
+#define NUM_SHARDS 0
+#endif
+// Dispatcher: keep pending events in a hierarchical timing wheel instead of a
+// binary heap, and take a waiting request's patience timer out when admitted
+#ifndef TIMER_WHEEL
+#define TIMER_WHEEL 0
+#endif
+// Run the dispatcher on a simulated clock: time jumps straight to the next
+// event instead of sleeping, so a trace replays as fast as it can be printed
+#ifndef VIRTUAL_CLOCK
+#define VIRTUAL_CLOCK 0
+#endif
+// Objects per arena chunk; chunks are never moved once allocated
+#ifndef REQUEST_CHUNK
+#define REQUEST_CHUNK 4096
+#endif
+// Dispatcher only: start serving while the trace is still being read. A reader
+// keeps at most INGEST_WINDOW parsed requests waiting for their arrival time;
+// requests must be sorted by request time.
+#ifndef STREAM_INPUT
+#define STREAM_INPUT 0
+#endif
+#ifndef INGEST_WINDOW
+#define INGEST_WINDOW 1024
+#endif
+// Digits after the decimal point in printed times (3 = ms, 6 = us)
+#ifndef TIME_DECIMALS
+#define TIME_DECIMALS 3
+#endif
+// Seconds between a request arriving and LAZY first looking at it
+#ifndef RESPONSE_DELAY
+#define RESPONSE_DELAY 1.0
+#endif
+// Serve queued writers before queued readers instead of strict arrival order
+#ifndef WRITER_PREFERENCE
+#define WRITER_PREFERENCE 0
+#endif
+// Order in which a file's queued requests are served: arrival order,
+// earliest patience deadline, shortest operation, or least work admitted so
+// far per unit of user weight (USER_WEIGHTS="user:weight,...", default 1).
+// Patience is one value for the whole trace, so EDF orders exactly as FIFO
+// does; it is kept as the policy per-request deadlines would plug into.
+#define POLICY_FIFO 0
+#define POLICY_EDF 1
+#define POLICY_SJF 2
+#define POLICY_FAIR 3
+#ifndef QUEUE_POLICY
+#define QUEUE_POLICY POLICY_FIFO
+#endif
+#ifndef USER_WEIGHTS
+#define USER_WEIGHTS ""
+#endif
+// Requests carry a priority (0-255, higher is more urgent) after their request
+// time. A file serves higher priorities first, but every PRIORITY_AGING seconds
+// since a request arrived count as one class more (0 = strict priority).
+#ifndef PRIORITIES
+#define PRIORITIES 0
+#endif
+#ifndef PRIORITY_AGING
+#define PRIORITY_AGING 1.0
+#endif
+// Seconds after a read starts during which other READs of the file join it
+// and complete with it instead of taking a slot of their own (0 = off)
+#ifndef READ_COALESCE
+#define READ_COALESCE 0
+#endif
+// Combine up to WRITE_BATCH writes of a file into one: WRITEs whose turn comes
+// within WRITE_DELAY seconds of a write starting complete with it (1 = off)
+#ifndef WRITE_BATCH
+#define WRITE_BATCH 1
+#endif
+#ifndef WRITE_DELAY
+#define WRITE_DELAY 0.1
+#endif
+// Keep a chain of versions per file: READs read the version committed when
+// they were admitted, so only writers exclude each other, and superseded
+// versions are reclaimed by epoch once no READ can still be reading them
+#ifndef MVCC
+#define MVCC 0
+#endif
+// Reject a request up front when the work already holding and queued on its
+// file cannot be done before its patience runs out
+#ifndef LOAD_SHEDDING
+#define LOAD_SHEDDING 0
+#endif
+// COPY/MOVE retry delay after finding a file busy, doubling up to the max
+#ifndef MULTI_BACKOFF
+#define MULTI_BACKOFF 0.01
+#endif
+#ifndef MULTI_BACKOFF_MAX
+#define MULTI_BACKOFF_MAX 0.16
+#endif
+// Independently locked shards of the per-user table
+#ifndef USER_SHARDS
+#define USER_SHARDS 64
+#endif
+// Per-user limits, 0 = none: a token bucket of USER_RATE requests per second
+// holding USER_BURST, and at most USER_QUOTA requests admitted or queued at
+// once. A request over either is rejected on its first attempt.
+#ifndef USER_RATE
+#define USER_RATE 0
+#endif
+#ifndef USER_BURST
+#define USER_BURST 10
+#endif
+#ifndef USER_QUOTA
+#define USER_QUOTA 0
+#endif
+#define USER_LIMITS (USER_RATE > 0 || USER_QUOTA > 0)
+// Print per-file queue depth and wait counters to stderr after the run
+#ifndef SHOW_ADMISSION_STATS
+#define SHOW_ADMISSION_STATS 0
+#endif
+// Summary of latencies, throughput and the busiest files on stderr at the end
+#ifndef SHOW_STATS
+#define SHOW_STATS 1
+#endif
+// Print that summary as one JSON object instead of text
+#ifndef STATS_JSON
+#define STATS_JSON 0
+#endif
+#ifndef STATS_HOT_FILES
+#define STATS_HOT_FILES 5
+#endif
+// Thread engine only: admit through one CAS-updated state word per file and
+// sleep on a futex instead of the mutex, condition variable and FIFO
+#ifndef LOCKFREE_ADMISSION
+#define LOCKFREE_ADMISSION 0
+#endif
+// Back every file with a real file DATA_DIR/file<id> of FILE_BYTES bytes and
+// do each operation's I/O when it is taken up: through pread/pwrite, through
+// one shared mapping per file, or with reads sent to a null sink by sendfile
+#define IO_NONE 0
+#define IO_PREAD 1
+#define IO_MMAP 2
+#define IO_SENDFILE 3
+#ifndef FILE_IO
+#define FILE_IO IO_NONE
+#endif
+#ifndef DATA_DIR
+#define DATA_DIR "lazy_data"
+#endif
+#ifndef FILE_BYTES
+#define FILE_BYTES 65536
+#endif
+// Backing files kept open at once; the least recently used idle one is closed
+// to make room
+#ifndef IO_MAX_OPEN
+#define IO_MAX_OPEN 256
+#endif
+// Dispatcher only: hand READ/WRITE I/O to an io_uring, or to IO_THREADS
+// threads if the kernel has none, and complete requests as it finishes
+#ifndef IO_ASYNC
+#define IO_ASYNC 0
+#endif
+#ifndef IO_RING_ENTRIES
+#define IO_RING_ENTRIES 256
+#endif
+#ifndef IO_THREADS
+#define IO_THREADS 2
+#endif
+// Hand console output to a drain thread through per-thread rings
+#ifndef ASYNC_LOG
+#define ASYNC_LOG 1
+#endif
+// Records per thread ring
+#ifndef LOG_RING
+#define LOG_RING 1024
+#endif
+// Seconds the drain holds a line back so late lines from other threads can
+// still be put in time order
+#ifndef LOG_REORDER
+#define LOG_REORDER 0.05
+#endif
+// ANSI colours in the event lines
+#ifndef LOG_COLOR
+#define LOG_COLOR 1
+#endif
+
+#if (VIRTUAL_CLOCK || STREAM_INPUT) && ENGINE == ENGINE_THREADS
+#error "VIRTUAL_CLOCK and STREAM_INPUT need the dispatcher engine"
+#endif
+#if NUM_SHARDS > 0 && (VIRTUAL_CLOCK || ENGINE != ENGINE_DISPATCHER)
+#error "NUM_SHARDS needs the dispatcher engine on the real clock"
+#endif
+#if IO_ASYNC && (FILE_IO != IO_PREAD || ENGINE != ENGINE_DISPATCHER || VIRTUAL_CLOCK)
+#error "IO_ASYNC needs FILE_IO=IO_PREAD and the dispatcher engine on the real clock"
+#endif
+#if MVCC && (LOCKFREE_ADMISSION || FILE_IO)
+#error "MVCC keeps versions in memory and needs the locked admission path without FILE_IO"
+#endif
+#if LOCKFREE_ADMISSION && (ENGINE != ENGINE_THREADS || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
+#error "LOCKFREE_ADMISSION needs the thread engine on a little-endian target"
+#endif
+
+#define USEC_PER_SEC 1000000L
+
+// Operation times, all in microseconds
+long read_time, write_time, delete_time;
+long copy_time, move_time;       // derived: read + write (+ delete for MOVE)
 int max_concurrent_access;
-int patience_time;
+long patience_time;
+
+struct Task;
+
+// Operations, parsed once from the input
+enum { OP_READ, OP_WRITE, OP_DELETE, OP_COPY, OP_MOVE, OP_CREATE, OP_INVALID, NUM_OPS };
+
+// How an admitted operation holds its file
+enum { HOLD_READER, HOLD_WRITER, HOLD_NONE };
+
+#define MAX_OP_FILES 2
+
+// What an operation does to one of the files it names
+typedef struct {
+    int exclusive;               // needs the file to itself
+    int hold;                    // which holder count it occupies while running
+    int deletes;                 // removes the file when admitted
+} FileRole;
+
+// Per-operation behaviour; admission and execution are driven from this table
+typedef struct {
+    const char *name;
+    int valid;
+    int num_files;               // COPY and MOVE name a source and a destination
+    FileRole roles[MAX_OP_FILES];
+    long *duration;
+} OpInfo;
+
+OpInfo op_table[NUM_OPS] = {
+    { "READ",    1, 1, { { 0, HOLD_READER, 0 } }, &read_time },
+    { "WRITE",   1, 1, { { 1, HOLD_WRITER, 0 } }, &write_time },
+    { "DELETE",  1, 1, { { 1, HOLD_NONE,   1 } }, &delete_time },
+    { "COPY",    1, 2, { { 0, HOLD_READER, 0 }, { 1, HOLD_WRITER, 0 } }, &copy_time },
+    { "MOVE",    1, 2, { { 1, HOLD_NONE,   1 }, { 1, HOLD_WRITER, 0 } }, &move_time },
+    { "CREATE",  1, 1, { { 1, HOLD_WRITER, 0 } }, &write_time },
+    { "UNKNOWN", 0, 1, { { 1, HOLD_NONE,   0 } }, &delete_time },
+};
+
+// Per-file admission state: current holders and the FIFO of waiting requests
+typedef struct {
+    int holders[2];              // indexed by HOLD_READER / HOLD_WRITER
+    struct Task *head;           // waiting requests in arrival (ticket) order
+    struct Task *tail;
+    int depth;                   // requests currently queued
+    int max_depth;
+    long admitted;
+    long waited;                 // admissions that had to queue first
+    long total_wait;
+    long max_wait;
+    long join_until;             // READ_COALESCE: last time a READ may join...
+    long join_done;              // ...the read in flight, which completes then
+    long batch_until;            // WRITE_BATCH: same for the write in flight,
+    long batch_done;
+    int batch_size;              // which has absorbed this many writes
+    long busy_until;             // when the current holders are all done
+    int ceiling;                 // PRIORITIES: highest priority queued
+} Admission;
+
+// Something epoch-based reclamation frees once nobody can reach it
+typedef struct Retired {
+    struct Retired *next;
+    void (*reclaim)(struct Retired *);
+} Retired;
+
+// Per-file totals for the run statistics
+typedef struct {
+    long completed;
+    long canceled;
+    long declined;
+    long shed;
+    long busy;                   // summed service time of every slot holder
+    long wait;                   // summed queue wait of started requests
+} FileStats;
+
+// File slot, one cache line apart so neighbouring locks do not share
+typedef struct File {
+    uint64_t state;              // LOCKFREE_ADMISSION state word, see fs_*()
+    int id;
+    int exists;                  // 0 once deleted: a tombstone
+    pthread_mutex_t lock;
+    Admission adm;
+    int fd;                      // FILE_IO backing file, -1 while not open
+    char *map;                   // its mapping under IO_MMAP
+    int io_pins;                 // operations doing I/O on it; not closed while any
+    int io_stale;                // renamed over or unlinked: close once unpinned
+    struct File *io_prev, *io_next;  // open files, most recently used first
+    struct Version *latest;      // MVCC: last committed version
+    Retired retired;             // tombstone awaiting reclamation
+} __attribute__((aligned(CACHE_LINE))) File;
+
+// Bits of File.state, see "Lock-free file state" below
+#define FS_EXISTS 1UL
+#define FS_WRITER 2UL
+#define FS_READER 4UL
+#define FS_READER_MASK 0xfffffffcUL
+#define FS_WAITER (1UL << 32)
+
+// Directory entry of a file id, see "File slots"
+typedef struct {
+    File *slot;                  // NULL while no file has the id
+    int id;
+    FileStats stats;             // across every slot the id has had
+} FileEntry;
+
+FileEntry *file_ids;             // dense directory indexed by file id - 1
+int num_files;
+
+// Dispatcher events, each one is a step of a request's life
+enum { EV_ARRIVE, EV_ATTEMPT, EV_COMPLETE, EV_CANCEL, NUM_EVENTS };
+
+// Request lifecycle
+enum { REQ_NEW, REQ_WAITING, REQ_ACTIVE, REQ_DECLINED, REQ_CANCELED, REQ_DONE, REQ_SHED, REQ_LIMITED };
+
+// What gets logged and counted about a request
+enum { LOG_REQUEST, LOG_DECLINE, LOG_CANCEL, LOG_START, LOG_COMPLETE, LOG_SHED, LOG_LIMIT };
+
+// Event queue entry; once due it is handed to the worker pool as a job
+typedef struct Timer {
+    long expires;
+    unsigned long seq;           // breaks ties between events at the same time
+    int event;
+    int slot;                    // TIMER_WHEEL: where it is queued, -1 once taken
+    struct Task *task;
+    struct Timer *next;
+    struct Timer *prev;          // TIMER_WHEEL: slots are circular lists
+} Timer;
+
+// Request structure, exactly as parsed from one input line
+typedef struct {
+    uint32_t user_id;
+    uint32_t file_id;
+    uint32_t dst_file_id;        // COPY/MOVE destination, 0 otherwise
+    uint8_t priority;            // PRIORITIES, 0 otherwise
+    uint64_t request_time : 56;  // microseconds
+    uint64_t op : 8;
+} Request;
+
+_Static_assert(sizeof(Request) == 24, "Request should stay 24 bytes");
+
+// A request LAZY is working on
+typedef struct Task {
+    Request req;
+    long seq;                    // position in the input
+    int state;
+    int timers;                  // events armed and not yet run
+    long enqueued_at;
+    long started_at;
+    struct User *user;           // looked up on first use
+    int within_limits;           // passed the USER_LIMITS check, holds a quota place
+    int attempts;                // failed multi-file admissions so far
+    long joined_until;           // completion of the read it joined, 0 if none
+    struct Version *version;     // MVCC: what a reader is reading...
+    long version_epoch;          // ...and the epoch it entered to read it
+    File *slots[MAX_OP_FILES];   // the files it names, looked up once
+    int bound;                   // slots[] looked up...
+    long slot_epoch;             // ...in this slot epoch
+    struct Task *next_waiter;    // admission queue, or IO_ASYNC submissions
+    pthread_cond_t *wakeup;      // waiting thread (thread-per-request engine)
+    Timer step;                  // arrival -> attempt -> completion
+    Timer cancel;                // patience expiry while waiting
+} Task;
+
+// Chunked arena of fixed-size objects: addresses stay valid while it grows,
+// and freed objects are recycled through a free list
+typedef struct {
+    size_t size;
+    char **chunks;
+    long num_chunks;
+    long count;
+    void *free_list;
+    pthread_mutex_t lock;
+} Arena;
+
+Arena requests = { sizeof(Request), NULL, 0, 0, NULL, PTHREAD_MUTEX_INITIALIZER };
+Arena tasks = { sizeof(Task), NULL, 0, 0, NULL, PTHREAD_MUTEX_INITIALIZER };
+long num_parsed = 0;
+struct timespec start_time;
+
+void *arena_at(Arena *arena, long i) {
+    return arena->chunks[i / REQUEST_CHUNK] + (i % REQUEST_CHUNK) * arena->size;
+}
+
+void *arena_alloc(Arena *arena) {
+    void *obj;
+    pthread_mutex_lock(&arena->lock);
+    if (arena->free_list) {
+        obj = arena->free_list;
+        arena->free_list = *(void **)obj;
+    } else {
+        if (arena->count == arena->num_chunks * REQUEST_CHUNK) {
+            if ((arena->num_chunks & (arena->num_chunks - 1)) == 0) {
+                long capacity = arena->num_chunks ? 2 * arena->num_chunks : 1;
+                char **chunks = realloc(arena->chunks, capacity * sizeof(char *));
+                if (!chunks) {
+                    fprintf(stderr, "Out of memory after %ld objects\n", arena->count);
+                    exit(1);
+                }
+                arena->chunks = chunks;
+            }
+            if (posix_memalign((void **)&arena->chunks[arena->num_chunks], CACHE_LINE,
+                               REQUEST_CHUNK * arena->size) != 0) {
+                fprintf(stderr, "Out of memory after %ld objects\n", arena->count);
+                exit(1);
+            }
+            arena->num_chunks++;
+        }
+        obj = arena_at(arena, arena->count++);
+    }
+    pthread_mutex_unlock(&arena->lock);
+    memset(obj, 0, arena->size);
+    return obj;
+}
+
+void arena_free(Arena *arena, void *obj) {
+    pthread_mutex_lock(&arena->lock);
+    *(void **)obj = arena->free_list;
+    arena->free_list = obj;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+void arena_destroy(Arena *arena) {
+    long i;
+    for (i = 0; i < arena->num_chunks; i++) {
+        free(arena->chunks[i]);
+    }
+    free(arena->chunks);
+}
+
+// Buffered whitespace-separated tokens from stdin; returns 0 at end of input
+char in_buf[1 << 16];
+int in_len, in_pos;
+
+int read_token(char *tok, int size) {
+    int n = 0, c;
+    while (1) {
+        if (in_pos == in_len) {
+            in_len = fread(in_buf, 1, sizeof(in_buf), stdin);
+            in_pos = 0;
+            if (in_len <= 0) break;
+        }
+        c = (unsigned char)in_buf[in_pos++];
+        if (c == ' ' || c == '\n' || c == '\t' || c == '\r') {
+            if (n > 0) break;
+            continue;
+        }
+        if (n < size - 1) tok[n++] = c;
+    }
+    tok[n] = '\0';
+    return n;
+}
+
+double read_number() {
+    char tok[64];
+    read_token(tok, sizeof(tok));
+    return atof(tok);
+}
+
+long seconds_to_us(double seconds) {
+    return (long)(seconds * USEC_PER_SEC + 0.5);
+}
+
+int parse_op(const char *name) {
+    int op;
+    for (op = 0; op < OP_INVALID; op++) {
+        if (strcmp(name, op_table[op].name) == 0) return op;
+    }
+    return OP_INVALID;
+}
+
+// Parse the next request line; 0 once STOP or the end of input is reached
+int parse_request(Request *req) {
+    char temp[100];
+    if (!read_token(temp, sizeof(temp)) || strcmp(temp, "STOP") == 0) return 0;
+    req->user_id = (uint32_t)atol(temp);
+    req->file_id = (uint32_t)read_number();
+    read_token(temp, sizeof(temp));
+    req->op = parse_op(temp);
+    req->dst_file_id = op_table[req->op].num_files > 1 ? (uint32_t)read_number() : 0;
+    req->request_time = seconds_to_us(read_number());
+    if (PRIORITIES) {
+        long priority = (long)read_number();
+        req->priority = priority < 0 ? 0 : priority > 255 ? 255 : priority;
+    }
+    return 1;
+}
+
+struct timespec timespec_after(struct timespec base, long us) {
+    base.tv_sec += us / USEC_PER_SEC;
+    base.tv_nsec += (us % USEC_PER_SEC) * 1000;
+    if (base.tv_nsec >= 1000000000L) {
+        base.tv_sec++;
+        base.tv_nsec -= 1000000000L;
+    }
+    return base;
+}
+
+// Microseconds since LAZY woke up, on the monotonic clock
+long elapsed_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start_time.tv_sec) * USEC_PER_SEC +
+           (now.tv_nsec - start_time.tv_nsec) / 1000;
+}
+
+// Seconds with TIME_DECIMALS digits, trailing zeros dropped ("3", "2.25")
+char *format_time(char *buf, long us) {
+    long unit = 1;
+    int i;
+    for (i = TIME_DECIMALS; i < 6; i++) unit *= 10;
+    long per_second = USEC_PER_SEC / unit;
+    long ticks = (us + unit / 2) / unit;
+    int n = sprintf(buf, "%ld", ticks / per_second);
+    if (ticks % per_second) {
+        n += sprintf(buf + n, ".%0*ld", TIME_DECIMALS, ticks % per_second);
+        while (buf[n - 1] == '0') buf[--n] = '\0';
+    }
+    return buf;
+}
+
+OpInfo *op_of(Task *task) {
+    return &op_table[task->req.op];
+}
+
+// The i-th file a request names, or NULL if there was no such file when it
+// looked its files up (see slot_bind)
+File *file_at(Task *task, int i) {
+    return task->slots[i];
+}
+
+File *file_of(Task *task) {
+    return file_at(task, 0);
+}
+
+// What `task` does to `file`, one of the files it names
+FileRole *role_of(Task *task, File *file) {
+    return &op_of(task)->roles[file == file_of(task) ? 0 : 1];
+}
+
+// ---------------------------------------------------------------------------
+// Run statistics
+//
+// Every lifecycle line also feeds the run statistics. Latencies go into
+// log-linear histograms in the style of HdrHistogram: 16 sub-buckets per
+// power of two, so any percentile is within about 6% of the true value.
+// Updates are relaxed atomics; the report is read after all threads stop.
+// ---------------------------------------------------------------------------
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    long counts[HIST_BUCKETS];
+    long total;
+    long max;
+} Histogram;
+
+typedef struct {
+    long requested;
+    long completed;
+    long canceled;
+    long declined;
+    long shed;                   // rejected up front by LOAD_SHEDDING
+    long limited;                // rejected by USER_RATE/USER_QUOTA
+    long aborted;                // multi-file admissions retried after backoff
+    long joined;                 // READs/WRITEs that joined one in flight
+} OpStats;
+
+typedef struct {
+    Histogram wait;              // first attempt -> taken up
+    Histogram service;           // taken up -> completed
+    Histogram response;          // request -> completed
+    OpStats ops[NUM_OPS];
+    long versions_created;       // MVCC, initial ones included
+    long versions_written;       // by WRITEs
+    long versions_reclaimed;
+    long versions_live;
+    long versions_max_live;
+    long slots_created;          // by CREATE
+    long slots_reclaimed;
+    long slots_live;
+    long slots_max_live;
+    long boosted;                // completions put ahead of queued jobs by priority inheritance
+    long end;                    // time of the last event
+} RunStats;
+
+RunStats stats;
+const char *policy_names[] = { "FIFO", "EDF", "SJF", "FAIR" };
+
+#define atomic_max(target, value) do {                                          \
+    __typeof__(*(target)) seen_ = __atomic_load_n((target), __ATOMIC_RELAXED);  \
+    __typeof__(*(target)) value_ = (value);                                     \
+    while (value_ > seen_ && !__atomic_compare_exchange_n((target), &seen_,     \
+               value_, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));                 \
+} while (0)
+
+int hist_bucket(long value) {
+    if (value < HIST_SUB) return value < 0 ? 0 : (int)value;
+    int magnitude = 63 - __builtin_clzl(value);
+    int sub = (int)(value >> (magnitude - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    return (magnitude - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+// Largest value that falls in `bucket`
+long hist_bucket_top(int bucket) {
+    if (bucket < HIST_SUB) return bucket;
+    int shift = bucket / HIST_SUB - 1;
+    long low = (long)(HIST_SUB + bucket % HIST_SUB) << shift;
+    return low + (1L << shift) - 1;
+}
+
+void hist_record(Histogram *h, long value) {
+    __atomic_add_fetch(&h->counts[hist_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->total, 1, __ATOMIC_RELAXED);
+    atomic_max(&h->max, value);
+}
+
+long hist_percentile(Histogram *h, double p) {
+    long rank = (long)(p * h->total + 0.999999), seen = 0;
+    int i;
+    if (rank < 1) rank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) return hist_bucket_top(i) < h->max ? hist_bucket_top(i) : h->max;
+    }
+    return h->max;
+}
+
+// Statistics of the i-th file id a request names, or NULL if out of range
+FileStats *stats_of(Task *task, int i) {
+    uint32_t id = i == 0 ? task->req.file_id : task->req.dst_file_id;
+    if (id < 1 || id > (uint32_t)num_files) return NULL;
+    return &file_ids[id - 1].stats;
+}
+
+void stats_record(int kind, Task *task, long time) {
+    OpStats *op = &stats.ops[task->req.op];
+    FileStats *file = stats_of(task, 0);
+    atomic_max(&stats.end, time);
+    switch (kind) {
+    case LOG_REQUEST:
+        __atomic_add_fetch(&op->requested, 1, __ATOMIC_RELAXED);
+        break;
+    case LOG_DECLINE:
+        __atomic_add_fetch(&op->declined, 1, __ATOMIC_RELAXED);
+        if (file) __atomic_add_fetch(&file->declined, 1, __ATOMIC_RELAXED);
+        break;
+    case LOG_CANCEL:
+        __atomic_add_fetch(&op->canceled, 1, __ATOMIC_RELAXED);
+        if (file) __atomic_add_fetch(&file->canceled, 1, __ATOMIC_RELAXED);
+        break;
+    case LOG_SHED:
+        __atomic_add_fetch(&op->shed, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&file->shed, 1, __ATOMIC_RELAXED);
+        break;
+    case LOG_LIMIT:
+        __atomic_add_fetch(&op->limited, 1, __ATOMIC_RELAXED);
+        break;
+    case LOG_START: {
+        long wait = time - task->req.request_time - seconds_to_us(RESPONSE_DELAY);
+        task->started_at = time;
+        if (task->joined_until) __atomic_add_fetch(&op->joined, 1, __ATOMIC_RELAXED);
+        hist_record(&stats.wait, wait);
+        __atomic_add_fetch(&file->wait, wait, __ATOMIC_RELAXED);
+        break;
+    }
+    case LOG_COMPLETE: {
+        int i;
+        hist_record(&stats.service, time - task->started_at);
+        hist_record(&stats.response, time - task->req.request_time);
+        __atomic_add_fetch(&op->completed, 1, __ATOMIC_RELAXED);
+        for (i = 0; i < op_table[task->req.op].num_files; i++) {
+            file = stats_of(task, i);
+            __atomic_add_fetch(&file->completed, 1, __ATOMIC_RELAXED);
+            // A joiner rode along in someone else's slot
+            if (!task->joined_until) __atomic_add_fetch(&file->busy, time - task->started_at, __ATOMIC_RELAXED);
+        }
+        break;
+    }
+    }
+}
+
+void stats_abort(Task *task) {
+    __atomic_add_fetch(&stats.ops[task->req.op].aborted, 1, __ATOMIC_RELAXED);
+}
+
+double us_to_seconds(long us) {
+    return (double)us / USEC_PER_SEC;
+}
+
+// Share of the file's max_concurrent_access slots in use over `duration` seconds
+double file_utilization(FileStats *f, double duration) {
+    if (duration <= 0 || max_concurrent_access <= 0) return 0.0;
+    return us_to_seconds(f->busy) / duration / max_concurrent_access;
+}
+
+// Files by busy time, busiest first
+int file_busier(const void *a, const void *b) {
+    long x = (*(FileEntry **)a)->stats.busy, y = (*(FileEntry **)b)->stats.busy;
+    return (x < y) - (x > y);
+}
+
+// Up to STATS_HOT_FILES busiest files into `hot`; returns how many
+int stats_hot_files(FileEntry **hot) {
+    FileEntry **all = malloc((num_files + 1) * sizeof(FileEntry *));
+    int i, n = 0;
+    for (i = 0; i < num_files; i++) {
+        FileStats *f = &file_ids[i].stats;
+        if (f->completed || f->canceled || f->declined || f->shed) all[n++] = &file_ids[i];
+    }
+    qsort(all, n, sizeof(FileEntry *), file_busier);
+    if (n > STATS_HOT_FILES) n = STATS_HOT_FILES;
+    memcpy(hot, all, n * sizeof(FileEntry *));
+    free(all);
+    return n;
+}
+
+void print_hist_text(const char *name, Histogram *h) {
+    char p50[32], p90[32], p99[32], max[32];
+    fprintf(stderr, "  %-9s p50 %s s, p90 %s s, p99 %s s, max %s s (%ld samples)\n", name,
+            format_time(p50, hist_percentile(h, 0.50)), format_time(p90, hist_percentile(h, 0.90)),
+            format_time(p99, hist_percentile(h, 0.99)), format_time(max, h->max), h->total);
+}
+
+void print_hist_json(const char *name, Histogram *h) {
+    fprintf(stderr, "\"%s\":{\"count\":%ld,\"p50\":%.6f,\"p90\":%.6f,\"p99\":%.6f,\"max\":%.6f}", name, h->total,
+            us_to_seconds(hist_percentile(h, 0.50)), us_to_seconds(hist_percentile(h, 0.90)),
+            us_to_seconds(hist_percentile(h, 0.99)), us_to_seconds(h->max));
+}
+
+// Summary of the run on stderr, as text or (STATS_JSON) one JSON object
+void print_stats() {
+    FileEntry *hot[STATS_HOT_FILES];
+    int n = stats_hot_files(hot), i;
+    double duration = us_to_seconds(stats.end);
+    char t[32], wait[32];
+
+    if (STATS_JSON) {
+        long requested = 0, completed = 0, canceled = 0, declined = 0, shed = 0, limited = 0;
+        for (i = 0; i < NUM_OPS; i++) {
+            requested += stats.ops[i].requested;
+            completed += stats.ops[i].completed;
+            canceled += stats.ops[i].canceled;
+            declined += stats.ops[i].declined;
+            shed += stats.ops[i].shed;
+            limited += stats.ops[i].limited;
+        }
+        fprintf(stderr, "{\"policy\":\"%s\",\"duration\":%.6f,\"requests\":%ld,\"completed\":%ld,\"canceled\":%ld,\"declined\":%ld,\"shed\":%ld,\"limited\":%ld,",
+                policy_names[QUEUE_POLICY], duration, requested, completed, canceled, declined, shed, limited);
+        print_hist_json("wait", &stats.wait);
+        fputc(',', stderr);
+        print_hist_json("service", &stats.service);
+        fputc(',', stderr);
+        print_hist_json("response", &stats.response);
+        if (MVCC) {
+            fprintf(stderr, ",\"versions\":{\"created\":%ld,\"written\":%ld,\"reclaimed\":%ld,\"max_live\":%ld}",
+                    stats.versions_created, stats.versions_written, stats.versions_reclaimed, stats.versions_max_live);
+        }
+        fprintf(stderr, ",\"slots\":{\"created\":%ld,\"reclaimed\":%ld,\"max_live\":%ld}",
+                stats.slots_created, stats.slots_reclaimed, stats.slots_max_live);
+        if (PRIORITIES) fprintf(stderr, ",\"boosted\":%ld", stats.boosted);
+        fprintf(stderr, ",\"ops\":{");
+        for (i = 0; i < NUM_OPS; i++) {
+            OpStats *op = &stats.ops[i];
+            fprintf(stderr, "%s\"%s\":{\"requested\":%ld,\"completed\":%ld,\"canceled\":%ld,\"declined\":%ld,\"shed\":%ld,\"limited\":%ld,\"aborted\":%ld,\"joined\":%ld,\"ops_per_sec\":%.3f}",
+                    i ? "," : "", op_table[i].name, op->requested, op->completed, op->canceled, op->declined, op->shed, op->limited,
+                    op->aborted, op->joined,
+                    duration > 0 ? op->completed / duration : 0.0);
+        }
+        fprintf(stderr, "},\"hot_files\":[");
+        for (i = 0; i < n; i++) {
+            FileStats *f = &hot[i]->stats;
+            fprintf(stderr, "%s{\"file\":%d,\"busy\":%.6f,\"utilization\":%.4f,\"completed\":%ld,\"canceled\":%ld,\"declined\":%ld,\"shed\":%ld,\"wait\":%.6f}",
+                    i ? "," : "", hot[i]->id, us_to_seconds(f->busy), file_utilization(f, duration),
+                    f->completed, f->canceled, f->declined, f->shed, us_to_seconds(f->wait));
+        }
+        fprintf(stderr, "]}\n");
+        return;
+    }
+
+    fprintf(stderr, "LAZY ran for %s seconds under the %s policy\n", format_time(t, stats.end), policy_names[QUEUE_POLICY]);
+    print_hist_text("wait", &stats.wait);
+    print_hist_text("service", &stats.service);
+    print_hist_text("response", &stats.response);
+    if (MVCC) {
+        fprintf(stderr, "  versions  %ld created (%ld by writes), %ld reclaimed, at most %ld in memory at once\n",
+                stats.versions_created, stats.versions_written, stats.versions_reclaimed, stats.versions_max_live);
+    }
+    if (stats.slots_created || stats.slots_reclaimed) {
+        fprintf(stderr, "  files     %ld created, %ld deleted and reclaimed, at most %ld in memory at once\n",
+                stats.slots_created, stats.slots_reclaimed, stats.slots_max_live);
+    }
+    if (PRIORITIES) {
+        fprintf(stderr, "  priority  %ld completions moved ahead of queued work by priority inheritance\n", stats.boosted);
+    }
+    for (i = 0; i < NUM_OPS; i++) {
+        OpStats *op = &stats.ops[i];
+        if (!op->requested) continue;
+        fprintf(stderr, "  %-9s %ld requested, %ld completed (%.3f ops/s), %ld canceled, %ld declined",
+                op_table[i].name, op->requested, op->completed, duration > 0 ? op->completed / duration : 0.0,
+                op->canceled, op->declined);
+        if (LOAD_SHEDDING) fprintf(stderr, ", %ld shed", op->shed);
+        if (USER_LIMITS) fprintf(stderr, ", %ld over user limits", op->limited);
+        if (op_table[i].num_files > 1) fprintf(stderr, ", %ld aborted attempts", op->aborted);
+        if (READ_COALESCE > 0 && i == OP_READ) fprintf(stderr, ", %ld joined a read in flight", op->joined);
+        if (WRITE_BATCH > 1 && i == OP_WRITE) fprintf(stderr, ", %ld combined into a batch", op->joined);
+        fputc('\n', stderr);
+    }
+    for (i = 0; i < n; i++) {
+        FileStats *f = &hot[i]->stats;
+        fprintf(stderr, "  file %d: busy %s s (%.1f%%), %ld completed, %ld canceled, %ld declined, ",
+                hot[i]->id, format_time(t, f->busy), 100 * file_utilization(f, duration),
+                f->completed, f->canceled, f->declined);
+        if (LOAD_SHEDDING) fprintf(stderr, "%ld shed, ", f->shed);
+        fprintf(stderr, "wait %s s\n", format_time(wait, f->wait));
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Console log
+//
+// Workers never touch stdout. Each thread appends fixed-size binary records
+// to its own single-producer ring; one drain thread collects them, orders them
+// by event time and formats them. A record is held back until the clock is
+// LOG_REORDER past its timestamp, so lines logged out of order by different
+// threads come out in time order as long as none is logged later than that.
+// With ASYNC_LOG=0 records are formatted and printed by the calling thread.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    long time;                   // event time, microseconds
+    uint32_t seq;                // per-thread order, breaks timestamp ties
+    uint32_t user_id;
+    uint32_t file_id;
+    uint32_t dst_file_id;
+    uint8_t kind;
+    uint8_t op;
+} LogRecord;
+
+typedef struct LogRing {
+    unsigned long head __attribute__((aligned(CACHE_LINE)));   // drain side
+    unsigned long tail __attribute__((aligned(CACHE_LINE)));   // producer side
+    uint32_t next_seq;
+    int closed;                  // producer has exited
+    struct LogRing *next;
+    LogRecord records[LOG_RING];
+} LogRing;
+
+const char *log_colors[] = { YELLOW, WHITE, RED, PINK, GREEN, RED, RED };
+
+LogRing *log_rings;              // every live ring, pushed with CAS
+__thread LogRing *log_ring;      // this thread's ring
+pthread_key_t log_key;           // marks a ring closed when its thread exits
+pthread_t log_drainer;
+int log_stopping;
+LogRecord *log_pending;          // drain-side min-heap by (time, seq)
+long log_pending_size, log_pending_capacity;
+
+void log_write(LogRecord *r) {
+    char t[32];
+    format_time(t, r->time);
+    if (LOG_COLOR) fputs(log_colors[r->kind], stdout);
+    switch (r->kind) {
+    case LOG_REQUEST:
+        if (op_table[r->op].num_files > 1) {
+            printf("User %u has made request for %s on file %u to file %u at %s seconds\n", r->user_id, op_table[r->op].name, r->file_id, r->dst_file_id, t);
+        } else {
+            printf("User %u has made request for %s on file %u at %s seconds\n", r->user_id, op_table[r->op].name, r->file_id, t);
+        }
+        break;
+    case LOG_DECLINE:
+        printf("LAZY has declined the request of User %u at %s seconds because an invalid/deleted file was requested.\n", r->user_id, t);
+        break;
+    case LOG_CANCEL:
+        printf("User %u canceled the request due to no response at %s seconds\n", r->user_id, t);
+        break;
+    case LOG_START:
+        printf("LAZY has taken up the request of User %u at %s seconds\n", r->user_id, t);
+        break;
+    case LOG_COMPLETE:
+        printf("The request for User %u was completed at %s seconds\n", r->user_id, t);
+        break;
+    case LOG_SHED:
+        printf("LAZY has rejected the request of User %u at %s seconds because it could not be served within its patience.\n", r->user_id, t);
+        break;
+    case LOG_LIMIT:
+        printf("LAZY has rejected the request of User %u at %s seconds because the user is over its rate or concurrency limit.\n", r->user_id, t);
+        break;
+    }
+    if (LOG_COLOR) fputs(RESET, stdout);
+}
+
+void log_close(void *ring) {
+    __atomic_store_n(&((LogRing *)ring)->closed, 1, __ATOMIC_RELEASE);
+}
+
+LogRing *log_register() {
+    LogRing *ring;
+    if (posix_memalign((void **)&ring, CACHE_LINE, sizeof(LogRing)) != 0) {
+        fprintf(stderr, "Out of memory for a log ring\n");
+        exit(1);
+    }
+    memset(ring, 0, sizeof(LogRing));
+    ring->next = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    pthread_setspecific(log_key, ring);
+    return ring;
+}
+
+// Log what happened to `task` at `time`
+void log_event(int kind, Task *task, long time) {
+    LogRecord r = { time, 0, task->req.user_id, task->req.file_id, task->req.dst_file_id, kind, task->req.op };
+    stats_record(kind, task, time);
+    if (!ASYNC_LOG) {
+        log_write(&r);
+        return;
+    }
+    LogRing *ring = log_ring;
+    if (!ring) ring = log_ring = log_register();
+    r.seq = ring->next_seq++;
+    unsigned long tail = ring->tail;
+    while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING) {
+        sched_yield();           // full: wait for the drain
+    }
+    ring->records[tail % LOG_RING] = r;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+int log_before(LogRecord *a, LogRecord *b) {
+    if (a->time != b->time) return a->time < b->time;
+    return a->seq < b->seq;
+}
+
+void log_pending_push(LogRecord *r) {
+    if (log_pending_size == log_pending_capacity) {
+        log_pending_capacity = log_pending_capacity ? 2 * log_pending_capacity : LOG_RING;
+        log_pending = realloc(log_pending, log_pending_capacity * sizeof(LogRecord));
+    }
+    long i = log_pending_size++;
+    while (i > 0 && log_before(r, &log_pending[(i - 1) / 2])) {
+        log_pending[i] = log_pending[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    log_pending[i] = *r;
+}
+
+void log_pending_pop() {
+    LogRecord *h = log_pending;
+    LogRecord last = h[--log_pending_size];
+    long i = 0;
+    while (1) {
+        long child = 2 * i + 1;
+        if (child >= log_pending_size) break;
+        if (child + 1 < log_pending_size && log_before(&h[child + 1], &h[child])) child++;
+        if (!log_before(&h[child], &last)) break;
+        h[i] = h[child];
+        i = child;
+    }
+    h[i] = last;
+}
+
+// Move every published record into the pending heap, freeing the rings of
+// threads that have exited. Returns the number of records collected.
+long log_collect() {
+    long collected = 0;
+    LogRing **link = &log_rings;
+    LogRing *ring;
+    while ((ring = __atomic_load_n(link, __ATOMIC_ACQUIRE)) != NULL) {
+        int closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        unsigned long head = ring->head;
+        unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, collected++) {
+            log_pending_push(&ring->records[head % LOG_RING]);
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+        // Only the drain unlinks; the list head may race with a new ring
+        if (closed && (link != &log_rings ||
+                       __atomic_compare_exchange_n(link, &ring, ring->next, 0,
+                                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))) {
+            if (link != &log_rings) *link = ring->next;
+            free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
+    return collected;
+}
+
+void *log_drain(void *arg) {
+    (void)arg;
+    struct timespec idle = { 0, 1000000 };
+    while (1) {
+        int stopping = __atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE);
+        long collected = log_collect();
+        // The simulated clock logs from one thread, already in order
+        long horizon = stopping || VIRTUAL_CLOCK ? LONG_MAX : elapsed_us() - seconds_to_us(LOG_REORDER);
+        while (log_pending_size > 0 && log_pending[0].time <= horizon) {
+            log_write(&log_pending[0]);
+            log_pending_pop();
+        }
+        if (stopping) break;
+        if (!collected) {
+            fflush(stdout);      // caught up: let the lines out before idling
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+void log_start() {
+    if (!ASYNC_LOG) return;
+    pthread_key_create(&log_key, log_close);
+    pthread_create(&log_drainer, NULL, log_drain, NULL);
+}
+
+// Flush everything; every other thread must have stopped logging
+void log_stop() {
+    if (!ASYNC_LOG) return;
+    __atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(log_drainer, NULL);
+    while (log_rings) {
+        LogRing *ring = log_rings;
+        log_rings = ring->next;
+        free(ring);
+    }
+    log_ring = NULL;
+    free(log_pending);
+    pthread_key_delete(log_key);
+}
+
+// ---------------------------------------------------------------------------
+// Users
+//
+// Per-user state, created on first use in a hash table split into
+// USER_SHARDS independently locked shards so lookups from different workers
+// rarely meet. Users are never removed, so a pointer stays valid for the run.
+// ---------------------------------------------------------------------------
+
+typedef struct User {
+    uint32_t id;
+    int weight;                  // share under POLICY_FAIR
+    long served;                 // microseconds of work admitted so far
+    long full_at;                // USER_RATE: when the token bucket is full again
+    int in_flight;               // USER_QUOTA: requests admitted or queued
+    struct User *next;           // hash chain
+} User;
+
+typedef struct {
+    pthread_mutex_t lock;
+    User **buckets;
+    long capacity;               // power of two
+    long count;
+} __attribute__((aligned(CACHE_LINE))) UserShard;
+
+UserShard user_shards[USER_SHARDS];
+Arena users = { sizeof(User), NULL, 0, 0, NULL, PTHREAD_MUTEX_INITIALIZER };
+
+uint32_t user_hash(uint32_t id) {
+    id ^= id >> 16;
+    id *= 0x45d9f3b;
+    id ^= id >> 16;
+    return id;
+}
+
+// Weight from USER_WEIGHTS ("user:weight,..."), 1 for anybody not listed
+int user_weight(uint32_t id) {
+    const char *p = USER_WEIGHTS;
+    while (*p) {
+        char *end;
+        unsigned long user = strtoul(p, &end, 10);
+        if (*end != ':') break;
+        long weight = strtol(end + 1, &end, 10);
+        if (user == id && weight > 0) return (int)weight;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return 1;
+}
+
+void user_shard_grow(UserShard *shard) {
+    long capacity = shard->capacity ? 2 * shard->capacity : 64, i;
+    User **buckets = calloc(capacity, sizeof(User *));
+    for (i = 0; i < shard->capacity; i++) {
+        User *u = shard->buckets[i];
+        while (u) {
+            User *next = u->next;
+            long b = (user_hash(u->id) / USER_SHARDS) & (capacity - 1);
+            u->next = buckets[b];
+            buckets[b] = u;
+            u = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->capacity = capacity;
+}
+
+User *user_get(uint32_t id) {
+    uint32_t h = user_hash(id);
+    UserShard *shard = &user_shards[h % USER_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    if (shard->count >= shard->capacity) user_shard_grow(shard);
+    User **bucket = &shard->buckets[(h / USER_SHARDS) & (shard->capacity - 1)];
+    User *u = *bucket;
+    while (u && u->id != id) u = u->next;
+    if (!u) {
+        u = arena_alloc(&users);
+        u->id = id;
+        u->weight = user_weight(id);
+        u->next = *bucket;
+        *bucket = u;
+        shard->count++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return u;
+}
+
+User *user_of(Task *task) {
+    if (!task->user) task->user = user_get(task->req.user_id);
+    return task->user;
+}
+
+// USER_RATE: take a token at `now`. The bucket is kept as the time it will be
+// full again (GCRA), so a token is there while that is less than USER_BURST
+// refill intervals ahead, and taking one is a single compare-and-swap.
+int user_take_token(User *u, long now) {
+    long interval = seconds_to_us(1.0 / (USER_RATE > 0 ? USER_RATE : 1));
+    long full_at = __atomic_load_n(&u->full_at, __ATOMIC_RELAXED), next;
+    do {
+        long from = full_at > now ? full_at : now;
+        if (from - now > (USER_BURST - 1) * interval) return 0;
+        next = from + interval;
+    } while (!__atomic_compare_exchange_n(&u->full_at, &full_at, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+// Whether the user of `task` may have it served at `now`; if so the request
+// holds one of the user's USER_QUOTA places until user_release()
+int user_admit(Task *task, long now) {
+    User *u = user_of(task);
+    if (USER_QUOTA > 0 && __atomic_add_fetch(&u->in_flight, 1, __ATOMIC_RELAXED) > USER_QUOTA) {
+        __atomic_sub_fetch(&u->in_flight, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (USER_RATE > 0 && !user_take_token(u, now)) {
+        if (USER_QUOTA > 0) __atomic_sub_fetch(&u->in_flight, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    task->within_limits = 1;
+    return 1;
+}
+
+void user_release(Task *task) {
+    if (USER_QUOTA > 0 && task->within_limits) __atomic_sub_fetch(&user_of(task)->in_flight, 1, __ATOMIC_RELAXED);
+    task->within_limits = 0;
+}
+
+void users_init() {
+    int i;
+    for (i = 0; i < USER_SHARDS; i++) pthread_mutex_init(&user_shards[i].lock, NULL);
+}
+
+void users_destroy() {
+    int i;
+    for (i = 0; i < USER_SHARDS; i++) {
+        pthread_mutex_destroy(&user_shards[i].lock);
+        free(user_shards[i].buckets);
+    }
+    arena_destroy(&users);
+}
+
+// ---------------------------------------------------------------------------
+// Epoch-based reclamation
+//
+// Objects that may still be reachable by requests in flight are retired
+// instead of freed. A domain has a global epoch; a request that may reach
+// its objects enters the current epoch first and leaves it when done, and a
+// retired object joins the current epoch's list. The epoch advances once no
+// member is left in the one before it, at which point the list retired three
+// epochs ago can no longer be reached and is reclaimed. Members are counted
+// per thread, each count on its own cache line, so entering and leaving take
+// no lock; a request may leave on another thread than it entered on, so only
+// the sum over threads means anything. Retiring pushes onto a lock-free list
+// that the next advance files under the epoch current then, which only ever
+// makes an object wait longer. Only advancing locks.
+// ---------------------------------------------------------------------------
+
+#define EPOCH_THREADS 64         // member counts; further threads share them
+
+typedef struct {
+    long members[3];             // entries minus exits in each of the last three epochs
+} __attribute__((aligned(CACHE_LINE))) EpochCounts;
+
+typedef struct {
+    pthread_mutex_t lock;        // retiring and advancing
+    long epoch;
+    long pending;                // retired and not yet reclaimed
+    Retired *incoming;           // retired since the last advance
+    Retired *retired[3];         // retired in each of the last three epochs
+    EpochCounts threads[EPOCH_THREADS];
+} EpochDomain;
+
+int epoch_thread() {
+    static int num_threads;
+    static __thread int self = -1;
+    if (self < 0) self = __atomic_fetch_add(&num_threads, 1, __ATOMIC_RELAXED) % EPOCH_THREADS;
+    return self;
+}
+
+long epoch_reclaim(Retired *r) {
+    long n = 0;
+    while (r) {
+        Retired *next = r->next;
+        r->reclaim(r);
+        r = next;
+        n++;
+    }
+    return n;
+}
+
+// Advance for as long as something is retired and nobody is left in the
+// epoch before the current one; three steps reclaim all there is. Caller
+// holds d->lock.
+void epoch_advance(EpochDomain *d) {
+    Retired *r = __atomic_exchange_n(&d->incoming, NULL, __ATOMIC_ACQUIRE);
+    while (r) {
+        Retired *next = r->next;
+        r->next = d->retired[d->epoch % 3];
+        d->retired[d->epoch % 3] = r;
+        r = next;
+    }
+    int step, i;
+    for (step = 0; step < 3 && __atomic_load_n(&d->pending, __ATOMIC_RELAXED) > 0; step++) {
+        long members = 0;
+        for (i = 0; i < EPOCH_THREADS; i++) {
+            members += __atomic_load_n(&d->threads[i].members[(d->epoch + 2) % 3], __ATOMIC_SEQ_CST);
+        }
+        if (members) return;
+        long e = d->epoch + 1;
+        __atomic_store_n(&d->epoch, e, __ATOMIC_SEQ_CST);
+        r = d->retired[e % 3];
+        d->retired[e % 3] = NULL;
+        __atomic_sub_fetch(&d->pending, epoch_reclaim(r), __ATOMIC_RELAXED);
+    }
+}
+
+// Count the caller in the current epoch. Checking the epoch again after
+// counting means an advance that missed the count has not happened yet, so
+// it will see the count when it looks at this epoch.
+long epoch_enter(EpochDomain *d) {
+    long *members = d->threads[epoch_thread()].members;
+    while (1) {
+        long e = __atomic_load_n(&d->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&members[e % 3], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&d->epoch, __ATOMIC_SEQ_CST) == e) return e;
+        __atomic_sub_fetch(&members[e % 3], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Try to advance, unless someone else already is
+void epoch_poll(EpochDomain *d) {
+    if (pthread_mutex_trylock(&d->lock) != 0) return;
+    epoch_advance(d);
+    pthread_mutex_unlock(&d->lock);
+}
+
+// Leave epoch `e`. Only leaving the epoch before the current one can let the
+// epoch advance, unless something retired has not been filed yet.
+void epoch_exit(EpochDomain *d, long e) {
+    __atomic_sub_fetch(&d->threads[epoch_thread()].members[e % 3], 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&d->pending, __ATOMIC_RELAXED)) return;
+    if (e + 1 == __atomic_load_n(&d->epoch, __ATOMIC_SEQ_CST) || __atomic_load_n(&d->incoming, __ATOMIC_RELAXED)) {
+        epoch_poll(d);
+    }
+}
+
+void epoch_retire(EpochDomain *d, Retired *r, void (*reclaim)(Retired *)) {
+    r->reclaim = reclaim;
+    __atomic_add_fetch(&d->pending, 1, __ATOMIC_RELAXED);
+    r->next = __atomic_load_n(&d->incoming, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&d->incoming, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    epoch_poll(d);
+}
+
+// Reclaim everything retired; nobody may be left in the domain
+void epoch_destroy(EpochDomain *d) {
+    int i;
+    epoch_reclaim(d->incoming);
+    d->incoming = NULL;
+    for (i = 0; i < 3; i++) {
+        epoch_reclaim(d->retired[i]);
+        d->retired[i] = NULL;
+    }
+    d->pending = 0;
+}
+
+// ---------------------------------------------------------------------------
+// Versions (MVCC)
+//
+// Every file holds its last committed version; a WRITE commits a new one when
+// it completes, superseding the old. A READ binds the latest version when it
+// is admitted and reads it until it completes, so readers never wait for
+// writers. A READ is a member of the version epoch domain from binding to
+// completion, and superseded versions are retired into it. Versions are
+// bookkeeping only: LAZY operations carry no data.
+// ---------------------------------------------------------------------------
+
+typedef struct Version {
+    Retired retired;             // first, so a retired version is a Retired
+    long number;                 // 1 for the initial contents, +1 per write
+    long committed_at;
+} Version;
+
+Arena versions = { sizeof(Version), NULL, 0, 0, NULL, PTHREAD_MUTEX_INITIALIZER };
+EpochDomain version_epochs = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void version_reclaim(Retired *r) {
+    __atomic_sub_fetch(&stats.versions_live, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.versions_reclaimed, 1, __ATOMIC_RELAXED);
+    arena_free(&versions, r);
+}
+
+// Make a new version of `file` its latest. Caller holds file->lock.
+void mvcc_commit(File *file, long now) {
+    Version *v = arena_alloc(&versions), *old = file->latest;
+    v->number = old ? old->number + 1 : 1;
+    v->committed_at = now;
+    file->latest = v;
+    __atomic_add_fetch(&stats.versions_created, 1, __ATOMIC_RELAXED);
+    atomic_max(&stats.versions_max_live, __atomic_add_fetch(&stats.versions_live, 1, __ATOMIC_RELAXED));
+    if (old) {
+        __atomic_add_fetch(&stats.versions_written, 1, __ATOMIC_RELAXED);
+        epoch_retire(&version_epochs, &old->retired, version_reclaim);
+    }
+}
+
+// The file is gone: its latest version is superseded by nothing
+void mvcc_drop(File *file) {
+    if (file->latest) epoch_retire(&version_epochs, &file->latest->retired, version_reclaim);
+    file->latest = NULL;
+}
+
+// A reader binds the latest version. Caller holds file->lock.
+void mvcc_bind(File *file, Task *task) {
+    task->version = file->latest;
+    task->version_epoch = epoch_enter(&version_epochs);
+}
+
+void mvcc_unbind(Task *task) {
+    epoch_exit(&version_epochs, task->version_epoch);
+    task->version = NULL;
+}
+
+// ---------------------------------------------------------------------------
+// File slots
+//
+// A file id names an entry of a dense directory sized from the input; the
+// entry points at the slot (lock, admission state, versions) holding the file
+// while it exists and keeps the id's statistics across slots. DELETE turns
+// its slot into a tombstone: the slot stops existing and leaves the
+// directory, so later requests for the id are declined and a CREATE may put
+// a fresh slot there. Requests look their files up once, on first attempt,
+// and are members of the slot epoch domain from just before that lookup until
+// they finish and none of their events is left, so a tombstone is recycled
+// only when no request can still reach it. Memory therefore follows the files that exist, not every file
+// that ever did.
+// ---------------------------------------------------------------------------
+
+Arena file_slots = { sizeof(File), NULL, 0, 0, NULL, PTHREAD_MUTEX_INITIALIZER };
+EpochDomain slot_epochs = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+FileEntry *entry_of(uint32_t id) {
+    if (id < 1 || id > (uint32_t)num_files) return NULL;
+    return &file_ids[id - 1];
+}
+
+File *slot_new(uint32_t id, long now) {
+    File *file = arena_alloc(&file_slots);
+    file->id = id;
+    file->exists = 1;
+    file->state = FS_EXISTS;
+    file->fd = -1;
+    pthread_mutex_init(&file->lock, NULL);
+    if (MVCC) mvcc_commit(file, now);
+    atomic_max(&stats.slots_max_live, __atomic_add_fetch(&stats.slots_live, 1, __ATOMIC_RELAXED));
+    return file;
+}
+
+void slot_free(File *file) {
+    if (MVCC) mvcc_drop(file);
+    pthread_mutex_destroy(&file->lock);
+    __atomic_sub_fetch(&stats.slots_live, 1, __ATOMIC_RELAXED);
+    arena_free(&file_slots, file);
+}
+
+void slot_reclaim(Retired *r) {
+    __atomic_add_fetch(&stats.slots_reclaimed, 1, __ATOMIC_RELAXED);
+    slot_free((File *)((char *)r - offsetof(File, retired)));
+}
+
+// A deleted file leaves the directory; its slot lives on as a tombstone for
+// whoever already looked it up
+void slot_tombstone(File *file) {
+    File *self = file;
+    if (MVCC) mvcc_drop(file);
+    __atomic_compare_exchange_n(&entry_of(file->id)->slot, &self, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    epoch_retire(&slot_epochs, &file->retired, slot_reclaim);
+}
+
+// Look up the files `task` names, once
+void slot_bind(Task *task) {
+    int i;
+    if (task->bound) return;
+    task->slot_epoch = epoch_enter(&slot_epochs);
+    task->bound = 1;
+    for (i = 0; i < op_of(task)->num_files; i++) {
+        FileEntry *entry = entry_of(i == 0 ? task->req.file_id : task->req.dst_file_id);
+        task->slots[i] = entry ? __atomic_load_n(&entry->slot, __ATOMIC_ACQUIRE) : NULL;
+    }
+}
+
+void slot_unbind(Task *task) {
+    if (task->bound) epoch_exit(&slot_epochs, task->slot_epoch);
+    task->bound = 0;
+}
+
+// CREATE: put a fresh slot under a free id with the creator already holding
+// it as a writer, so requests that find it wait for the creation to finish.
+// Declined if the id is out of range or taken.
+int slot_create(Task *task, long now) {
+    FileEntry *entry = entry_of(task->req.file_id);
+    File *expected = NULL;
+    if (!entry || __atomic_load_n(&entry->slot, __ATOMIC_ACQUIRE)) return REQ_DECLINED;
+    File *file = slot_new(task->req.file_id, now);
+    file->state |= FS_WRITER;
+    file->adm.holders[HOLD_WRITER] = 1;
+    file->adm.admitted = 1;
+    if (!__atomic_compare_exchange_n(&entry->slot, &expected, file, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        slot_free(file);         // another CREATE got there first
+        return REQ_DECLINED;
+    }
+    task->slots[0] = file;
+    __atomic_add_fetch(&stats.slots_created, 1, __ATOMIC_RELAXED);
+    return REQ_ACTIVE;
+}
+
+// Hand a queued request its outcome (REQ_ACTIVE, REQ_DECLINED or
+// REQ_CANCELED); each engine defines how the request learns about it.
+void settle_waiter(File *file, Task *task, int state, long now);
+
+// ---------------------------------------------------------------------------
+// Per-file admission
+//
+// A request may start only when nobody the scheduling policy puts ahead of
+// it is queued and it is compatible with the file's current holders.
+// Releases keep admitting the policy's next pick until it does not fit, so
+// consecutive READs are admitted as one batch and a WRITE is never overtaken
+// by READs ordered after it. Under POLICY_FIFO the order is arrival order;
+// with WRITER_PREFERENCE, queued writers go before any queued reader under
+// every policy. The queue is kept in arrival order and picks scan it, which
+// is cheap for the short per-file queues LAZY sees. All callers hold
+// file->lock.
+// ---------------------------------------------------------------------------
+
+// The only place max_concurrent_access is enforced
+int admit_compatible(File *file, Task *task) {
+    Admission *adm = &file->adm;
+    FileRole *role = role_of(task, file);
+    int holding = adm->holders[HOLD_READER] + adm->holders[HOLD_WRITER];
+    if (holding >= max_concurrent_access) return 0;
+    if (MVCC && role->hold == HOLD_WRITER) return adm->holders[HOLD_WRITER] == 0;
+    return !role->exclusive || holding == 0;
+}
+
+// Whether `task` reads a version of `file`, so that under MVCC no writer,
+// running or queued, holds it up
+int admit_reads_version(File *file, Task *task) {
+    return MVCC && role_of(task, file)->hold == HOLD_READER;
+}
+
+// Share of the file's time `task` takes up: all of it for exclusive access,
+// one slot's worth for a shared one
+long admit_cost(File *file, Task *task) {
+    long duration = *op_of(task)->duration;
+    return role_of(task, file)->exclusive ? duration : duration / max_concurrent_access;
+}
+
+void admit_unlink(File *file, Task *task, long now) {
+    Admission *adm = &file->adm;
+    Task **link = &adm->head;
+    Task *prev = NULL;
+    while (*link != task) {
+        prev = *link;
+        link = &(*link)->next_waiter;
+    }
+    *link = task->next_waiter;
+    if (adm->tail == task) adm->tail = prev;
+    task->next_waiter = NULL;
+    if (PRIORITIES && task->req.priority == adm->ceiling) {
+        Task *t;
+        int ceiling = 0;
+        for (t = adm->head; t; t = t->next_waiter) {
+            if (t->req.priority > ceiling) ceiling = t->req.priority;
+        }
+        __atomic_store_n(&adm->ceiling, ceiling, __ATOMIC_RELAXED);
+    }
+
+    adm->depth--;
+    long waited = now - task->enqueued_at;
+    adm->total_wait += waited;
+    if (waited > adm->max_wait) adm->max_wait = waited;
+}
+
+// Count `task` as a holder of the file
+void admit_take(File *file, Task *task, long now) {
+    Admission *adm = &file->adm;
+    FileRole *role = role_of(task, file);
+    adm->admitted++;
+    if (role->hold != HOLD_NONE) adm->holders[role->hold]++;
+    if (admit_reads_version(file, task)) mvcc_bind(file, task);
+    if (now + *op_of(task)->duration > adm->busy_until) adm->busy_until = now + *op_of(task)->duration;
+    if (READ_COALESCE > 0 && task->req.op == OP_READ) {
+        // A new read in flight: later READs may join it for a while
+        adm->join_until = now + seconds_to_us(READ_COALESCE);
+        adm->join_done = now + read_time;
+    }
+    if (WRITE_BATCH > 1 && task->req.op == OP_WRITE) {
+        adm->batch_until = now + seconds_to_us(WRITE_DELAY);
+        adm->batch_done = now + write_time;
+        adm->batch_size = 1;
+    }
+    if (QUEUE_POLICY == POLICY_FAIR && file == file_of(task)) {
+        __atomic_add_fetch(&user_of(task)->served, *op_of(task)->duration, __ATOMIC_RELAXED);
+    }
+    if (role->deletes) {
+        // Everybody still queued on a deleted file is turned away now
+        file->exists = 0;
+        slot_tombstone(file);
+        while (adm->head) {
+            Task *w = adm->head;
+            admit_unlink(file, w, now);
+            settle_waiter(file, w, REQ_DECLINED, now);
+        }
+    }
+}
+
+// Whether `a` arrived before `b`: by request time, then by input position.
+// Compared rather than read off the queue, so that a COPY/MOVE retrying
+// outside the queue still takes its real place in line.
+int arrived_before(Task *a, Task *b) {
+    if (a->req.request_time != b->req.request_time) return a->req.request_time < b->req.request_time;
+    return a->seq < b->seq;
+}
+
+// Whether the policy serves `a` strictly before `b` on `file`
+int admit_before(File *file, Task *a, Task *b) {
+    if (PRIORITIES && a->req.priority != b->req.priority) {
+        // Aging: arriving PRIORITY_AGING earlier is worth one class, which
+        // comes down to comparing arrival times shifted by priority
+        long aging = seconds_to_us(PRIORITY_AGING);
+        if (aging == 0) return a->req.priority > b->req.priority;
+        return (long)a->req.request_time - a->req.priority * aging <
+               (long)b->req.request_time - b->req.priority * aging;
+    }
+    int a_exclusive = role_of(a, file)->exclusive;
+    if (WRITER_PREFERENCE && a_exclusive != role_of(b, file)->exclusive) {
+        return a_exclusive;
+    }
+    switch (QUEUE_POLICY) {
+    case POLICY_EDF: {
+        // Same as arrival order while every request has the same patience
+        long a_deadline = a->req.request_time + patience_time, b_deadline = b->req.request_time + patience_time;
+        if (a_deadline != b_deadline) return a_deadline < b_deadline;
+        return a->seq < b->seq;
+    }
+    case POLICY_SJF:
+        return *op_of(a)->duration < *op_of(b)->duration;
+    case POLICY_FAIR: {
+        // Least work admitted per unit of weight goes first
+        User *ua = user_of(a), *ub = user_of(b);
+        return __atomic_load_n(&ua->served, __ATOMIC_RELAXED) * ub->weight <
+               __atomic_load_n(&ub->served, __ATOMIC_RELAXED) * ua->weight;
+    }
+    default:
+        return arrived_before(a, b);
+    }
+}
+
+// The queued request the policy serves next, leaving out writers if
+// `past_writers`; ties keep arrival order
+Task *admit_pick(File *file, int past_writers) {
+    Task *best = NULL, *t;
+    for (t = file->adm.head; t; t = t->next_waiter) {
+        if (past_writers && role_of(t, file)->hold == HOLD_WRITER) continue;
+        if (!best || admit_before(file, t, best)) best = t;
+    }
+    return best;
+}
+
+// Whether `task` would not jump the queue. Whatever the policy picks from the
+// queue is known not to fit, so only a request the policy puts ahead of that
+// pick may go straight in.
+int admit_in_turn(File *file, Task *task) {
+    Task *pick = admit_pick(file, admit_reads_version(file, task));
+    return !pick || admit_before(file, task, pick);
+}
+
+// Whether `task` may be admitted now without jumping the queue
+int admit_ready(File *file, Task *task) {
+    return admit_in_turn(file, task) && admit_compatible(file, task);
+}
+
+// Let a READ ride along with the read in flight on the file if that started
+// within READ_COALESCE, or combine a WRITE into the write in flight if that
+// started within WRITE_DELAY and has absorbed fewer than WRITE_BATCH writes.
+// The joiner takes no holder slot and completes when the operation it joined
+// does. Callers check it is the joiner's turn, so nothing queued ahead of it
+// (a READ before a WRITE, a DELETE) is overtaken.
+int admit_join(File *file, Task *task, long now) {
+    Admission *adm = &file->adm;
+    if (READ_COALESCE > 0 && task->req.op == OP_READ &&
+        now <= adm->join_until && now < adm->join_done) {
+        task->joined_until = adm->join_done;
+    } else if (WRITE_BATCH > 1 && task->req.op == OP_WRITE && adm->batch_size < WRITE_BATCH &&
+               now <= adm->batch_until && now < adm->batch_done) {
+        task->joined_until = adm->batch_done;
+        adm->batch_size++;
+    } else {
+        return 0;
+    }
+    if (admit_reads_version(file, task)) mvcc_bind(file, task);
+    adm->admitted++;
+    return 1;
+}
+
+// Admit `task` immediately if it would not jump the queue
+int admit_try(File *file, Task *task, long now) {
+    if (!admit_in_turn(file, task)) return 0;
+    if (admit_join(file, task, now)) return 1;
+    if (!admit_compatible(file, task)) return 0;
+    admit_take(file, task, now);
+    return 1;
+}
+
+void admit_enqueue(File *file, Task *task, long now) {
+    Admission *adm = &file->adm;
+    task->state = REQ_WAITING;
+    task->enqueued_at = now;
+    task->next_waiter = NULL;
+    if (adm->tail) adm->tail->next_waiter = task;
+    else adm->head = task;
+    adm->tail = task;
+
+    adm->waited++;
+    if (++adm->depth > adm->max_depth) adm->max_depth = adm->depth;
+    if (PRIORITIES && task->req.priority > adm->ceiling) {
+        __atomic_store_n(&adm->ceiling, task->req.priority, __ATOMIC_RELAXED);
+    }
+}
+
+// Priority inheritance: whether a request more urgent than `task` is queued on
+// a file it holds. Operations take the time they take, so what it inherits is
+// its place among the events waiting for a worker.
+int admit_inherits(Task *task) {
+    int i;
+    for (i = 0; i < op_of(task)->num_files; i++) {
+        if (__atomic_load_n(&file_at(task, i)->adm.ceiling, __ATOMIC_RELAXED) > task->req.priority) return 1;
+    }
+    return 0;
+}
+
+// LOAD_SHEDDING: whether `task`, which could not be admitted, is certain to
+// still be queued when its patience runs out. This is a lower bound on its
+// start, so nothing that could have completed is shed: an exclusive request
+// waits for the holders, none of which is done before busy_until. Then each
+// request the policy serves first and `task` could not run alongside holds it
+// up by that request's share of the file (admit_cost), or only until that
+// request's own patience runs out if that is sooner, as it then leaves the
+// queue without running.
+int admit_hopeless(File *file, Task *task, long now) {
+    Admission *adm = &file->adm;
+    FileRole *role = role_of(task, file);
+    int mvcc_writer = MVCC && role->hold == HOLD_WRITER;    // only waits for writers
+    int may_join = WRITE_BATCH > 1 && task->req.op == OP_WRITE && now <= adm->batch_until;
+    long start = now, deadline = task->req.request_time + patience_time;
+    Task *w;
+    if (role->exclusive && !mvcc_writer && !may_join && adm->busy_until > start) start = adm->busy_until;
+    for (w = adm->head; w && start < deadline; w = w->next_waiter) {
+        FileRole *ahead = role_of(w, file);
+        if (!admit_before(file, w, task)) continue;
+        if (!role->exclusive && !ahead->exclusive) continue;
+        if (admit_reads_version(file, task) && ahead->hold == HOLD_WRITER) continue;
+        if (mvcc_writer && ahead->hold != HOLD_WRITER) continue;
+        long gives_up = w->req.request_time + patience_time;
+        long done = start + admit_cost(file, w);
+        if (done > gives_up) done = gives_up > start ? gives_up : start;
+        start = done;
+    }
+    return start >= deadline;
+}
+
+// Admit queued requests for as long as the file allows
+void admit_next(File *file, long now) {
+    Admission *adm = &file->adm;
+    while (adm->head && file->exists) {
+        Task *next = admit_pick(file, 0);
+        if (MVCC && role_of(next, file)->hold == HOLD_WRITER && !admit_compatible(file, next)) {
+            // A writer waiting for the writer in flight holds up no reader
+            Task *reader = admit_pick(file, 1);
+            if (!reader || !admit_reads_version(file, reader)) break;
+            next = reader;
+        }
+        if (now - next->req.request_time >= patience_time) {
+            // Patience ran out at this very instant; it no longer competes
+            admit_unlink(file, next, now);
+            settle_waiter(file, next, REQ_CANCELED, now);
+            continue;
+        }
+        if (admit_join(file, next, now)) {
+            admit_unlink(file, next, now);
+            settle_waiter(file, next, REQ_ACTIVE, now);
+            continue;
+        }
+        if (!admit_compatible(file, next)) break;
+        admit_unlink(file, next, now);
+        admit_take(file, next, now);
+        settle_waiter(file, next, REQ_ACTIVE, now);
+    }
+}
+
+void admit_release(File *file, Task *task, long now) {
+    FileRole *role = role_of(task, file);
+    if (role->hold != HOLD_NONE && !task->joined_until) file->adm.holders[role->hold]--;
+    if (admit_reads_version(file, task)) mvcc_unbind(task);
+    if (MVCC && role->hold == HOLD_WRITER && !task->joined_until) mvcc_commit(file, now);
+    admit_next(file, now);
+}
+
+// ---------------------------------------------------------------------------
+// Multi-file requests
+//
+// COPY and MOVE need both of their files at once. They never queue: an
+// attempt locks both files in file id order, so two attempts cannot
+// deadlock, and takes both admissions only if each file would admit the
+// request right now. Otherwise nothing is held and the attempt is retried
+// after an exponential backoff, so a request never sits on one file while
+// waiting for another. Each failed attempt counts as aborted in the stats.
+// ---------------------------------------------------------------------------
+
+// Validate the second file of a multi-file request; its id differs from the
+// first's, which admit_pair relies on for its lock order
+int multi_files_valid(Task *task) {
+    File *dst = file_at(task, 1);
+    return dst && dst->id != file_of(task)->id;
+}
+
+// Try to take both admissions: REQ_ACTIVE, REQ_DECLINED if either file is
+// gone, or REQ_WAITING if either is busy
+int admit_pair(Task *task, long now) {
+    File *src = file_of(task), *dst = file_at(task, 1);
+    File *first = src->id < dst->id ? src : dst, *second = src->id < dst->id ? dst : src;
+    int outcome;
+
+    pthread_mutex_lock(&first->lock);
+    pthread_mutex_lock(&second->lock);
+    if (!src->exists || !dst->exists) {
+        outcome = REQ_DECLINED;
+    } else if (admit_ready(src, task) && admit_ready(dst, task)) {
+        // The deleting side goes last so the other side is checked on a live file
+        admit_take(dst, task, now);
+        admit_take(src, task, now);
+        outcome = REQ_ACTIVE;
+    } else {
+        outcome = REQ_WAITING;
+    }
+    pthread_mutex_unlock(&second->lock);
+    pthread_mutex_unlock(&first->lock);
+    return outcome;
+}
+
+// When to try again after a failed attempt, never past the patience deadline
+long multi_retry_at(Task *task, long now) {
+    int doublings = task->attempts < 16 ? task->attempts : 16;
+    long backoff = seconds_to_us(MULTI_BACKOFF) << doublings;
+    long cap = seconds_to_us(MULTI_BACKOFF_MAX);
+    long deadline = task->req.request_time + patience_time;
+    task->attempts++;
+    stats_abort(task);
+    if (backoff > cap) backoff = cap;
+    return now + backoff < deadline ? now + backoff : deadline;
+}
+
+// ---------------------------------------------------------------------------
+// File backing (FILE_IO)
+//
+// Each file is a real file DATA_DIR/file<id>, created at FILE_BYTES on first
+// use and kept across runs. The thread that takes an operation up does its
+// I/O: READ reads the whole file, WRITE rewrites it from a shared pattern,
+// DELETE unlinks it, COPY copies source into destination inside the kernel
+// and MOVE renames one onto the other. None of them copies through an
+// intermediate user buffer except IO_PREAD reads. A READ or WRITE that joined
+// one in flight does no I/O of its own. The operation then completes after
+// its configured duration or when its I/O is done, whichever is later, so a
+// trace with zero durations measures the I/O alone; on the virtual clock the
+// I/O is done but takes no simulated time. The dispatcher takes a request up
+// under its file's lock but does the I/O once the event has dropped it. As
+// READs are admitted alongside a WRITE, a READ may see the file half written,
+// through the mapping as through pread.
+//
+// A file is opened (and mapped) by the first operation that does I/O on it
+// and stays open for the next, up to IO_MAX_OPEN files: opening one more
+// closes the least recently used file no operation is pinning. Only when
+// every open file is pinned does the count run past IO_MAX_OPEN, by at most
+// the operations in flight.
+// ---------------------------------------------------------------------------
+
+int io_sink = -1;                // /dev/null, where IO_SENDFILE reads go
+char *io_pattern;                // what every WRITE writes
+__thread char *io_buffer;        // IO_PREAD read target, one per thread
+pthread_key_t io_buffer_key;     // frees it when its thread exits
+unsigned long io_checksum;       // keeps IO_MMAP reads from being optimised out
+
+pthread_mutex_t io_files_lock = PTHREAD_MUTEX_INITIALIZER;  // guards the below and fd/map/io_pins
+File *io_newest, *io_oldest;     // open files, most recently used first
+int io_num_open;
+
+void io_path(char *buf, File *file) {
+    snprintf(buf, PATH_MAX, "%s/file%d", DATA_DIR, file->id);
+}
+
+void io_error(const char *what, File *file) {
+    fprintf(stderr, "LAZY could not %s file %d: %s\n", what, file->id, strerror(errno));
+}
+
+void io_unlist(File *file) {
+    if (file->io_prev) file->io_prev->io_next = file->io_next;
+    else io_newest = file->io_next;
+    if (file->io_next) file->io_next->io_prev = file->io_prev;
+    else io_oldest = file->io_prev;
+}
+
+void io_list(File *file) {
+    file->io_prev = NULL;
+    file->io_next = io_newest;
+    if (io_newest) io_newest->io_prev = file;
+    else io_oldest = file;
+    io_newest = file;
+}
+
+// Under io_files_lock
+void io_close(File *file) {
+    if (file->fd < 0) return;
+    io_unlist(file);
+    io_num_open--;
+    if (file->map) munmap(file->map, FILE_BYTES);
+    close(file->fd);
+    file->fd = -1;
+    file->map = NULL;
+    file->io_stale = 0;
+}
+
+// Under io_files_lock
+void io_open(File *file) {
+    char path[PATH_MAX];
+    struct stat st;
+    File *victim = io_oldest;
+    while (io_num_open >= IO_MAX_OPEN && victim) {
+        File *newer = victim->io_prev;
+        if (victim->io_pins == 0) io_close(victim);
+        victim = newer;
+    }
+    io_path(path, file);
+    file->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (file->fd < 0 || fstat(file->fd, &st) != 0 ||
+        (st.st_size < FILE_BYTES && ftruncate(file->fd, FILE_BYTES) != 0)) {
+        io_error("open", file);
+        exit(1);
+    }
+    file->map = NULL;
+    if (FILE_IO == IO_MMAP) {
+        file->map = mmap(NULL, FILE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+        if (file->map == MAP_FAILED) {
+            io_error("map", file);
+            exit(1);
+        }
+    }
+    io_list(file);
+    io_num_open++;
+}
+
+// Open `file` if it is not, and keep it open until io_release
+void io_acquire(File *file) {
+    pthread_mutex_lock(&io_files_lock);
+    if (file->fd < 0) {
+        io_open(file);
+    } else if (io_newest != file) {
+        io_unlist(file);
+        io_list(file);
+    }
+    file->io_pins++;
+    pthread_mutex_unlock(&io_files_lock);
+}
+
+void io_release(File *file) {
+    pthread_mutex_lock(&io_files_lock);
+    if (--file->io_pins == 0 && file->io_stale) io_close(file);
+    pthread_mutex_unlock(&io_files_lock);
+}
+
+// `file`'s name no longer refers to what it has open. READs run alongside a
+// MOVE onto their file, so whoever is still using the old one keeps it (and
+// whoever comes before they are done shares it) until the last lets go.
+void io_forget(File *file) {
+    pthread_mutex_lock(&io_files_lock);
+    if (file->io_pins == 0) io_close(file);
+    else file->io_stale = 1;
+    pthread_mutex_unlock(&io_files_lock);
+}
+
+void io_init() {
+    int i;
+    if (mkdir(DATA_DIR, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "LAZY could not create %s: %s\n", DATA_DIR, strerror(errno));
+        exit(1);
+    }
+    io_pattern = malloc(FILE_BYTES);
+    for (i = 0; i < FILE_BYTES; i++) io_pattern[i] = 'a' + i % 26;
+    io_sink = open("/dev/null", O_WRONLY);
+    pthread_key_create(&io_buffer_key, free);
+}
+
+void io_destroy() {
+    while (io_newest) io_close(io_newest);
+    if (io_sink >= 0) close(io_sink);
+    free(io_pattern);
+    free(io_buffer);             // the main thread's, which runs no destructors
+    io_buffer = NULL;
+    pthread_key_delete(io_buffer_key);
+}
+
+void io_read(File *file) {
+    off_t off = 0;
+    ssize_t n = 1;
+    if (FILE_IO == IO_MMAP) {
+        unsigned long sum = 0, *words = (unsigned long *)file->map;
+        size_t i;
+        for (i = 0; i < FILE_BYTES / sizeof(long); i++) sum += words[i];
+        __atomic_add_fetch(&io_checksum, sum, __ATOMIC_RELAXED);
+        return;
+    }
+    if (FILE_IO == IO_PREAD && !io_buffer) {
+        io_buffer = malloc(FILE_BYTES);
+        pthread_setspecific(io_buffer_key, io_buffer);
+    }
+    while (off < FILE_BYTES && n > 0) {
+        if (FILE_IO == IO_SENDFILE) {
+            n = sendfile(io_sink, file->fd, &off, FILE_BYTES - off);
+        } else if ((n = pread(file->fd, io_buffer + off, FILE_BYTES - off, off)) > 0) {
+            off += n;
+        }
+    }
+    if (n < 0) io_error("read", file);
+}
+
+void io_write(File *file) {
+    off_t off = 0;
+    ssize_t n = 1;
+    if (FILE_IO == IO_MMAP) {
+        memcpy(file->map, io_pattern, FILE_BYTES);
+        return;
+    }
+    while (off < FILE_BYTES && n > 0) {
+        if ((n = pwrite(file->fd, io_pattern + off, FILE_BYTES - off, off)) > 0) off += n;
+    }
+    if (n < 0) io_error("write", file);
+}
+
+// Never opened, the file may not have been created yet
+void io_unlink(File *file) {
+    char path[PATH_MAX];
+    io_path(path, file);
+    if (unlink(path) != 0 && errno != ENOENT) io_error("unlink", file);
+    io_forget(file);
+}
+
+void io_copy(File *src, File *dst) {
+    loff_t in = 0, out = 0;
+    ssize_t n = 1;
+    io_acquire(src);
+    io_acquire(dst);
+    while (in < FILE_BYTES && n > 0) {
+        n = copy_file_range(src->fd, &in, dst->fd, &out, FILE_BYTES - in, 0);
+    }
+    if (n < 0) io_error("copy", src);
+    io_release(dst);
+    io_release(src);
+}
+
+// The destination's name now refers to the source's file; both are reopened
+// by name when next used
+void io_move(File *src, File *dst) {
+    char from[PATH_MAX], to[PATH_MAX];
+    io_path(from, src);
+    io_path(to, dst);
+    io_acquire(src);             // creates it if nothing has yet
+    io_release(src);
+    if (rename(from, to) != 0) {
+        io_error("move", src);
+        return;
+    }
+    io_forget(dst);
+    io_forget(src);
+}
+
+
+// Take up `task` at `now`: do its I/O and return when it completes
+long run_operation(Task *task, long now) {
+    long done = now + *op_of(task)->duration;
+    File *file = file_of(task);
+    if (task->joined_until) return task->joined_until;
+    if (!FILE_IO) return done;
+    switch (task->req.op) {
+    case OP_READ:
+    case OP_WRITE:
+    case OP_CREATE:
+        io_acquire(file);
+        if (task->req.op == OP_READ) io_read(file);
+        else if (task->req.op == OP_WRITE) io_write(file);
+        io_release(file);
+        break;
+    case OP_DELETE: io_unlink(file); break;
+    case OP_COPY: io_copy(file, file_at(task, 1)); break;
+    case OP_MOVE: io_move(file, file_at(task, 1)); break;
+    }
+    if (!VIRTUAL_CLOCK && elapsed_us() > done) done = elapsed_us();
+    return done;
+}
+
+// ---------------------------------------------------------------------------
+// Thread-per-request engine
+// ---------------------------------------------------------------------------
+
+void settle_thread(Task *task, int state) {
+    task->state = state;
+    pthread_cond_signal(task->wakeup);
+}
+
+void sleep_until(long us) {
+    struct timespec until = timespec_after(start_time, us);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) != 0);
+}
+
+// Admission through the file's FIFO; sleeps on a condition variable until a
+// release admits the request or patience runs out. Returns the outcome.
+int admit_blocking(File *file, Task *task, long *now) {
+    pthread_mutex_lock(&file->lock);
+    if (!file->exists) {
+        task->state = REQ_DECLINED;
+    } else if (admit_try(file, task, *now)) {
+        task->state = REQ_ACTIVE;
+    } else if (LOAD_SHEDDING && admit_hopeless(file, task, *now)) {
+        task->state = REQ_SHED;
+    } else {
+        pthread_cond_t wakeup;
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&wakeup, &attr);
+        pthread_condattr_destroy(&attr);
+        task->wakeup = &wakeup;
+        admit_enqueue(file, task, *now);
+
+        struct timespec deadline = timespec_after(start_time, task->req.request_time + patience_time);
+        while (task->state == REQ_WAITING) {
+            if (pthread_cond_timedwait(&wakeup, &file->lock, &deadline) == ETIMEDOUT) break;
+        }
+        *now = elapsed_us();
+        if (task->state == REQ_WAITING) {
+            // Timed out: report the instant patience ran out
+            *now = task->req.request_time + patience_time;
+            admit_unlink(file, task, *now);
+            task->state = REQ_CANCELED;
+        }
+        pthread_cond_destroy(&wakeup);
+    }
+    pthread_mutex_unlock(&file->lock);
+    return task->state;
+}
+
+// ---------------------------------------------------------------------------
+// Lock-free file state (LOCKFREE_ADMISSION)
+//
+// The whole admission state of a file is one 64-bit word updated with CAS:
+// bit 0 exists, bit 1 writer, bits 2-31 reader count, bits 32-63 sleeping
+// waiters. Blocked threads sleep on the low 32 bits with a futex, and a
+// release only enters the kernel when the waiter count is non-zero. There is
+// no queue, so admission order is not FIFO.
+// ---------------------------------------------------------------------------
+
+int fs_holding(uint64_t state) {
+    return (int)((state & FS_READER_MASK) / FS_READER) + ((state & FS_WRITER) ? 1 : 0);
+}
+
+// Whether `role` may be admitted in `state`; -1 if the file is gone
+int fs_admissible(uint64_t state, FileRole *role) {
+    if (!(state & FS_EXISTS)) return -1;
+    int holding = fs_holding(state);
+    if (holding >= max_concurrent_access) return 0;
+    return !role->exclusive || holding == 0;
+}
+
+uint32_t *fs_futex(File *file) {
+    return (uint32_t *)&file->state;     // low half on little-endian
+}
+
+void fs_wake_all(File *file) {
+    syscall(SYS_futex, fs_futex(file), FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Returns 1 once admitted, -1 if the file does not exist, 0 if it must wait
+int fs_try_admit(File *file, FileRole *role) {
+    uint64_t old = __atomic_load_n(&file->state, __ATOMIC_ACQUIRE);
+    while (1) {
+        int admissible = fs_admissible(old, role);
+        if (admissible != 1) return admissible;
+        uint64_t new = old;
+        if (role->hold == HOLD_READER) new += FS_READER;
+        if (role->hold == HOLD_WRITER) new |= FS_WRITER;
+        if (role->deletes) new &= ~FS_EXISTS;
+        if (__atomic_compare_exchange_n(&file->state, &old, new, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (role->deletes) {
+                // Waiters on a deleted file must come and see it gone
+                slot_tombstone(file);
+                if (new >> 32) fs_wake_all(file);
+            }
+            return 1;
+        }
+    }
+}
+
+void fs_release(File *file, FileRole *role) {
+    uint64_t state;
+    if (role->hold == HOLD_READER) {
+        state = __atomic_sub_fetch(&file->state, FS_READER, __ATOMIC_ACQ_REL);
+    } else if (role->hold == HOLD_WRITER) {
+        state = __atomic_and_fetch(&file->state, ~FS_WRITER, __ATOMIC_ACQ_REL);
+    } else {
+        return;
+    }
+    if (state >> 32) fs_wake_all(file);
+}
+
+int admit_lockfree(File *file, Task *task, long *now) {
+    Admission *adm = &file->adm;
+    FileRole *role = role_of(task, file);
+    long enqueued_at = *now;
+    int waited = 0;
+    struct timespec deadline = timespec_after(start_time, task->req.request_time + patience_time);
+
+    int result;
+    while ((result = fs_try_admit(file, role)) == 0) {
+        if (*now - task->req.request_time >= patience_time) break;
+
+        // Register as a waiter, then re-check so a release that happened
+        // before registering is not missed
+        uint64_t state = __atomic_add_fetch(&file->state, FS_WAITER, __ATOMIC_ACQ_REL);
+        if (!waited) {
+            waited = 1;
+            __atomic_add_fetch(&adm->waited, 1, __ATOMIC_RELAXED);
+        }
+        atomic_max(&adm->max_depth, (int)(state >> 32));
+        if (fs_admissible(state, role) == 0) {
+            syscall(SYS_futex, fs_futex(file), FUTEX_WAIT_BITSET_PRIVATE, (uint32_t)state,
+                    &deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+        }
+        __atomic_sub_fetch(&file->state, FS_WAITER, __ATOMIC_ACQ_REL);
+        *now = elapsed_us();
+    }
+
+    if (result == 0) {
+        // Timed out: report the instant patience ran out
+        *now = task->req.request_time + patience_time;
+    }
+    if (waited) {
+        __atomic_add_fetch(&adm->total_wait, *now - enqueued_at, __ATOMIC_RELAXED);
+        atomic_max(&adm->max_wait, *now - enqueued_at);
+    }
+    if (result == 1) __atomic_add_fetch(&adm->admitted, 1, __ATOMIC_RELAXED);
+    return result == 1 ? REQ_ACTIVE : result < 0 ? REQ_DECLINED : REQ_CANCELED;
+}
+
+// Both admissions of a multi-file request or neither: the destination is
+// taken first and given back if the (possibly deleting) source is busy
+int admit_pair_lockfree(Task *task) {
+    File *src = file_of(task), *dst = file_at(task, 1);
+    int result = fs_try_admit(dst, role_of(task, dst));
+    if (result != 1) return result < 0 ? REQ_DECLINED : REQ_WAITING;
+    result = fs_try_admit(src, role_of(task, src));
+    if (result != 1) {
+        fs_release(dst, role_of(task, dst));
+        return result < 0 ? REQ_DECLINED : REQ_WAITING;
+    }
+    __atomic_add_fetch(&src->adm.admitted, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dst->adm.admitted, 1, __ATOMIC_RELAXED);
+    return REQ_ACTIVE;
+}
+
+// Retry a multi-file request with backoff until admitted, declined or out of
+// patience
+int admit_multi_blocking(Task *task, long *now) {
+    while (1) {
+        int outcome = LOCKFREE_ADMISSION ? admit_pair_lockfree(task) : admit_pair(task, *now);
+        if (outcome != REQ_WAITING) return outcome;
+        long retry_at = multi_retry_at(task, *now);
+        if (retry_at - task->req.request_time >= patience_time) {
+            *now = retry_at;
+            return REQ_CANCELED;
+        }
+        sleep_until(retry_at);
+        *now = elapsed_us();
+    }
+}
+
+// Everything after the request's files are looked up
+void serve_request(Task *task, long elapsed_time) {
+    File *file = file_of(task);
+    int num_files = op_of(task)->num_files, i;
+    if (USER_LIMITS && !user_admit(task, elapsed_time)) {
+        log_event(LOG_LIMIT, task, elapsed_time);
+        return;
+    }
+    if (task->req.op != OP_CREATE &&
+        (!file || !op_of(task)->valid || (num_files > 1 && !multi_files_valid(task)))) {
+        log_event(LOG_DECLINE, task, elapsed_time);
+        return;
+    }
+
+    int outcome;
+    if (task->req.op == OP_CREATE) {
+        outcome = slot_create(task, elapsed_time);
+        file = file_of(task);
+    } else if (num_files > 1) {
+        outcome = admit_multi_blocking(task, &elapsed_time);
+    } else if (LOCKFREE_ADMISSION) {
+        outcome = admit_lockfree(file, task, &elapsed_time);
+    } else {
+        outcome = admit_blocking(file, task, &elapsed_time);
+    }
+    if (outcome == REQ_CANCELED) {
+        log_event(LOG_CANCEL, task, elapsed_time);
+        return;
+    }
+    if (outcome == REQ_SHED) {
+        log_event(LOG_SHED, task, elapsed_time);
+        return;
+    }
+    if (outcome != REQ_ACTIVE) {
+        log_event(LOG_DECLINE, task, elapsed_time);
+        return;
+    }
+    log_event(LOG_START, task, elapsed_time);
+
+    // Simulate the operation
+    sleep_until(run_operation(task, elapsed_time));
+    elapsed_time = elapsed_us();
+    log_event(LOG_COMPLETE, task, elapsed_time);
+
+    task->state = REQ_DONE;
+    for (i = 0; i < num_files; i++) {
+        file = file_at(task, i);
+        if (LOCKFREE_ADMISSION) {
+            fs_release(file, role_of(task, file));
+        } else {
+            pthread_mutex_lock(&file->lock);
+            admit_release(file, task, elapsed_time);
+            pthread_mutex_unlock(&file->lock);
+        }
+    }
+}
+
+void *process_request(void *arg) {
+    Task local = { .req = *(Request *)arena_at(&requests, (long)arg), .seq = (long)arg };
+    Task *task = &local;
+
+    sleep_until(task->req.request_time);
+    log_event(LOG_REQUEST, task, task->req.request_time);
+    sleep_until(task->req.request_time + seconds_to_us(RESPONSE_DELAY));
+
+    long elapsed_time = elapsed_us();
+    if (elapsed_time - task->req.request_time >= patience_time) {
+        log_event(LOG_CANCEL, task, elapsed_time);
+        return NULL;
+    }
+    slot_bind(task);
+    serve_request(task, elapsed_time);
+    if (USER_LIMITS) user_release(task);
+    slot_unbind(task);
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Event-driven dispatcher
+//
+// An event queue ordered by (time, insertion order) owns every deadline
+// (arrival, first attempt, operation completion, patience expiry). Due events
+// become jobs for a fixed pool of workers. A request that cannot be taken up
+// parks on its file's admission queue and is admitted by whichever request
+// releases the file, at the release time. With VIRTUAL_CLOCK the events are
+// run inline, in order, and the clock jumps from one event to the next. With
+// NUM_SHARDS every shard has its own queue, run inline by its own thread.
+// Arrivals are ordered by input position and run before any other event at
+// the same time, so a streamed trace replays exactly like a preloaded one.
+// ---------------------------------------------------------------------------
+
+#define ARRIVAL_SEQS (1UL << 62)
+
+// Timing wheel: level L has 64 slots of 64^L us, enough levels for any time
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 11
+
+// Pending events: a binary min-heap, or with TIMER_WHEEL a timing wheel
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;         // signalled on a new earliest event or when done
+    Timer **heap;
+    int size;
+    int capacity;
+    unsigned long next_seq;
+    long wheel_now;              // no queued event is due before this...
+    uint64_t wheel_used[WHEEL_LEVELS];           // ...occupied slots per level
+    Timer *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+    void *freed_tasks;           // NUM_SHARDS: tasks its thread finished with...
+    void *reused_tasks;          // ...and those the ingesting thread took back
+} __attribute__((aligned(CACHE_LINE))) EventQueue;
 
-// File structure
 typedef struct {
-    int id;
-    int exists;
     pthread_mutex_t lock;
-    sem_t access_sem;
-    int readers;
-    int writers;
-} File;
+    pthread_cond_t cond;
+    Timer *head;
+    Timer *tail;
+    int shutdown;
+} JobQueue;
 
-File files[MAX_FILES];
-int num_files;
+EventQueue events;
+JobQueue jobs;
+EventQueue shards[NUM_SHARDS > 0 ? NUM_SHARDS : 1];
+long pending_requests;           // parsed requests that have not finished, atomic
+
+// Streaming input: requests parsed but not yet arrived, bounded by INGEST_WINDOW
+pthread_mutex_t ingest_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ingest_cond = PTHREAD_COND_INITIALIZER;
+long ingest_window;
+int ingest_done = !STREAM_INPUT;
+long ingest_watermark;           // request time of the last parsed request
+
+// Events of a request all go to one queue: the shared one, or with
+// NUM_SHARDS the shard owning the request's file
+EventQueue *queue_of(Task *task) {
+    return NUM_SHARDS > 0 ? &shards[task->req.file_id % NUM_SHARDS] : &events;
+}
+
+// Queue a job for the workers, at the head if `urgent`. Returns whether it
+// went ahead of jobs already queued.
+int job_push(Timer *t, int urgent) {
+    pthread_mutex_lock(&jobs.lock);
+    int ahead = urgent && jobs.head;
+    t->next = NULL;
+    if (ahead) {
+        t->next = jobs.head;
+        jobs.head = t;
+    } else {
+        if (jobs.tail) jobs.tail->next = t;
+        else jobs.head = t;
+        jobs.tail = t;
+    }
+    pthread_cond_signal(&jobs.cond);
+    pthread_mutex_unlock(&jobs.lock);
+    return ahead;
+}
+
+Timer *job_pop() {
+    pthread_mutex_lock(&jobs.lock);
+    while (!jobs.head && !jobs.shutdown) {
+        pthread_cond_wait(&jobs.cond, &jobs.lock);
+    }
+    Timer *t = jobs.head;
+    if (t) {
+        jobs.head = t->next;
+        if (!jobs.head) jobs.tail = NULL;
+    }
+    pthread_mutex_unlock(&jobs.lock);
+    return t;
+}
+
+// Work-stealing executor (EXECUTOR_STEALING): one Chase-Lev deque per worker.
+// The dispatcher is the only thread that pushes, at the bottom of the deque of
+// the worker a file is homed on; workers take from the top with a CAS, their
+// own deque first, then from randomly picked victims, and park when every
+// deque is empty. A hot file's backlog is thus spread over idle workers while
+// its work otherwise stays on one worker.
+
+typedef struct DequeArray {
+    long size;                   // power of two
+    struct DequeArray *retired;  // smaller arrays thieves may still be reading
+    Timer *slots[];
+} DequeArray;
 
-// Request structure
 typedef struct {
-    int user_id;
-    int file_id;
-    char operation[10];
-    int request_time;
-} Request;
+    long top __attribute__((aligned(CACHE_LINE)));
+    long bottom __attribute__((aligned(CACHE_LINE)));
+    DequeArray *array;
+} Deque;
 
-Request requests[MAX_USERS];
-int num_requests = 0;
-time_t start_time;
+#define STEAL_RETRY ((Timer *)1)
 
-// Function to process each user request
-void *process_request(void *arg) {
-    Request *req = (Request *)arg;
-    int can_take_request = 0;
-    int time_to_wait = req->request_time;
+Deque deques[NUM_WORKERS];
+pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+int parked;                      // workers asleep on park_cond
+int steal_shutdown;
+
+void deque_push(Deque *d, Timer *t) {
+    long bottom = d->bottom;
+    long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    DequeArray *a = d->array;
+    if (!a || bottom - top >= a->size) {
+        long size = a ? 2 * a->size : 64, i;
+        DequeArray *grown = malloc(sizeof(DequeArray) + size * sizeof(Timer *));
+        grown->size = size;
+        grown->retired = a;
+        for (i = top; i < bottom; i++) grown->slots[i & (size - 1)] = a->slots[i & (a->size - 1)];
+        __atomic_store_n(&d->array, grown, __ATOMIC_RELEASE);
+        a = grown;
+    }
+    __atomic_store_n(&a->slots[bottom & (a->size - 1)], t, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_SEQ_CST);
+}
+
+// The oldest job, NULL if empty, or STEAL_RETRY if another thief won the race
+Timer *deque_steal(Deque *d) {
+    long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) return NULL;
+    DequeArray *a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+    Timer *t = __atomic_load_n(&a->slots[top & (a->size - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return STEAL_RETRY;
+    }
+    return t;
+}
+
+int deques_empty() {
+    int i;
+    for (i = 0; i < NUM_WORKERS; i++) {
+        if (__atomic_load_n(&deques[i].top, __ATOMIC_SEQ_CST) <
+            __atomic_load_n(&deques[i].bottom, __ATOMIC_SEQ_CST)) return 0;
+    }
+    return 1;
+}
+
+void steal_submit(Timer *t) {
+    deque_push(&deques[t->task->req.file_id % NUM_WORKERS], t);
+    // Pairs with the parking worker counting itself before its last look
+    if (__atomic_load_n(&parked, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&park_lock);
+        pthread_cond_signal(&park_cond);
+        pthread_mutex_unlock(&park_lock);
+    }
+}
 
-    sleep(time_to_wait);
-    printf(YELLOW "User %d has made request for %s on file %d at %d seconds\n" RESET,
-               req->user_id, req->operation, req->file_id, req->request_time);
-    sleep(1);
+void steal_finish() {
+    pthread_mutex_lock(&park_lock);
+    steal_shutdown = 1;
+    pthread_cond_broadcast(&park_cond);
+    pthread_mutex_unlock(&park_lock);
+}
+
+void deques_destroy() {
+    int i;
+    for (i = 0; i < NUM_WORKERS; i++) {
+        DequeArray *a = deques[i].array;
+        while (a) {
+            DequeArray *retired = a->retired;
+            free(a);
+            a = retired;
+        }
+    }
+}
+
+int event_before(Timer *a, Timer *b) {
+    if (a->expires != b->expires) return a->expires < b->expires;
+    return a->seq < b->seq;
+}
+
+// Hierarchical timing wheel (TIMER_WHEEL). A timer sits on the lowest level
+// whose bits are the highest in which its time differs from wheel_now, in the
+// slot those bits pick, so everything on a level is due before anything on the
+// levels above and the earliest event is a find-first-set away. When only
+// higher levels are left, wheel_now moves to the start of the earliest
+// occupied slot and its timers are spread over the levels below, which
+// happens at most once per level per timer. A level-0 slot is a single
+// microsecond kept in (time, insertion order); anything already due goes to
+// the current one.
+void wheel_insert(EventQueue *q, Timer *t) {
+    long at = t->expires > q->wheel_now ? t->expires : q->wheel_now;
+    unsigned long diff = (unsigned long)(at ^ q->wheel_now);
+    int level = diff ? (63 - __builtin_clzl(diff)) / WHEEL_BITS : 0;
+    int index = (at >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+    Timer **head = &q->wheel[level][index];
+    t->slot = level * WHEEL_SLOTS + index;
+    q->wheel_used[level] |= 1UL << index;
+    if (!*head) {
+        t->next = t->prev = t;
+        *head = t;
+        return;
+    }
+    // Append, stepping back over later events on level 0; events are mostly
+    // added in order, so this rarely moves
+    Timer *after = (*head)->prev;
+    int first = 0;
+    while (level == 0 && event_before(t, after)) {
+        if (after == *head) {
+            after = after->prev;
+            first = 1;
+            break;
+        }
+        after = after->prev;
+    }
+    t->prev = after;
+    t->next = after->next;
+    after->next->prev = t;
+    after->next = t;
+    if (first) *head = t;
+}
+
+void wheel_unlink(EventQueue *q, Timer *t) {
+    int level = t->slot / WHEEL_SLOTS, index = t->slot % WHEEL_SLOTS;
+    Timer **head = &q->wheel[level][index];
+    if (t->next == t) {
+        *head = NULL;
+        q->wheel_used[level] &= ~(1UL << index);
+    } else {
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        if (*head == t) *head = t->next;
+    }
+    t->slot = -1;
+}
 
+// The earliest event, cascading higher levels down as needed
+Timer *wheel_first(EventQueue *q) {
     while (1) {
-    int elapsed_time = (int)(time(NULL) - start_time);
-    // printf("Elapsed time: %d\n", elapsed_time);
-    if (elapsed_time - req->request_time >= patience_time) {
-        printf(RED "User %d canceled the request due to no response at %d seconds\n" RESET, req->user_id, elapsed_time);
-        pthread_exit(NULL);
+        int level = 0;
+        while (level < WHEEL_LEVELS && !q->wheel_used[level]) level++;
+        if (level == WHEEL_LEVELS) return NULL;
+        int index = __builtin_ctzl(q->wheel_used[level]);
+        if (level == 0) return q->wheel[0][index];
+
+        int shift = level * WHEEL_BITS;
+        unsigned long keep = shift + WHEEL_BITS < 64 ? ~0UL << (shift + WHEEL_BITS) : 0;
+        q->wheel_now = (long)(((unsigned long)q->wheel_now & keep) | ((unsigned long)index << shift));
+        Timer *t = q->wheel[level][index];
+        q->wheel[level][index] = NULL;
+        q->wheel_used[level] &= ~(1UL << index);
+        t->prev->next = NULL;
+        while (t) {
+            Timer *next = t->next;
+            wheel_insert(q, t);
+            t = next;
+        }
     }
+}
 
-    File *file = &files[req->file_id - 1];
-    pthread_mutex_lock(&file->lock);
+// The earliest event without removing it, NULL if none. Caller holds q->lock.
+Timer *event_peek(EventQueue *q) {
+    if (TIMER_WHEEL) return wheel_first(q);
+    return q->size > 0 ? q->heap[0] : NULL;
+}
 
-    // Check if file exists and conditions for taking up the request
-    can_take_request = 1;
-    if (!file->exists) {
-        printf(WHITE "LAZY has declined the request of User %d at %d seconds because an invalid/deleted file was requested.\n" RESET, req->user_id, elapsed_time);
-        pthread_mutex_unlock(&file->lock);
-        pthread_exit(NULL);
-    } else if (strcmp(req->operation, "WRITE") == 0) {
-        if (file->writers > 0 || file->readers > 0) {  
-            can_take_request = 0;
+// Remove the earliest event. Caller holds q->lock.
+Timer *event_pop(EventQueue *q) {
+    if (TIMER_WHEEL) {
+        Timer *t = wheel_first(q);
+        wheel_unlink(q, t);
+        if (t->expires > q->wheel_now) q->wheel_now = t->expires;
+        return t;
+    }
+    Timer **h = q->heap;
+    Timer *top = h[0];
+    Timer *last = h[--q->size];
+    int i = 0;
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= q->size) break;
+        if (child + 1 < q->size && event_before(h[child + 1], h[child])) child++;
+        if (!event_before(h[child], last)) break;
+        h[i] = h[child];
+        i = child;
+    }
+    if (q->size > 0) h[i] = last;
+    return top;
+}
+
+// Schedule `event` for `task` at `expires`
+void timer_add(Timer *t, long expires, int event, Task *task) {
+    t->expires = expires;
+    t->event = event;
+    t->task = task;
+    t->next = NULL;
+    __atomic_add_fetch(&task->timers, 1, __ATOMIC_SEQ_CST);
+
+    EventQueue *q = queue_of(task);
+    pthread_mutex_lock(&q->lock);
+    t->seq = event == EV_ARRIVE ? (unsigned long)task->seq : ARRIVAL_SEQS + q->next_seq++;
+    if (TIMER_WHEEL) {
+        wheel_insert(q, t);
+        if (wheel_first(q) == t) pthread_cond_signal(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+    if (q->size == q->capacity) {
+        q->capacity = q->capacity ? 2 * q->capacity : 64;
+        q->heap = realloc(q->heap, q->capacity * sizeof(Timer *));
+    }
+    int i = q->size++;
+    while (i > 0 && event_before(t, q->heap[(i - 1) / 2])) {
+        q->heap[i] = q->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    q->heap[i] = t;
+    if (i == 0) pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Take back an event of `task` that has not been handed out yet. Only the
+// wheel can; the heap leaves the event to run and find nothing to do.
+void timer_cancel(Timer *t, Task *task) {
+    if (!TIMER_WHEEL) return;
+    EventQueue *q = queue_of(task);
+    pthread_mutex_lock(&q->lock);
+    int queued = t->slot >= 0;
+    if (queued) wheel_unlink(q, t);
+    pthread_mutex_unlock(&q->lock);
+    if (queued) __atomic_sub_fetch(&task->timers, 1, __ATOMIC_SEQ_CST);
+}
+
+// Whether every request has been parsed and has finished
+int dispatch_finished() {
+    return __atomic_load_n(&ingest_done, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&pending_requests, __ATOMIC_ACQUIRE) == 0;
+}
+
+// Let shard threads see dispatch_finished(); signalled under each shard's
+// lock so a shard about to wait cannot miss it
+void wake_shards() {
+    int i;
+    for (i = 0; i < NUM_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        pthread_cond_signal(&shards[i].cond);
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Asynchronous file I/O (IO_ASYNC)
+//
+// A READ or WRITE taken up is put on a submission list instead of doing its
+// I/O in place, and its completion event is scheduled once the I/O is done,
+// no earlier than its configured duration. One thread owns an io_uring set up
+// with raw system calls: it moves everything on the list into the submission
+// ring, submits the batch and reaps completions in a single io_uring_enter,
+// and is woken for new submissions by an eventfd read it keeps in the ring.
+// Where io_uring is unavailable, IO_THREADS threads take submissions off the
+// list and do them with pread/pwrite. READs land in one scratch buffer
+// nobody looks at; WRITEs come from the shared pattern.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_size, cq_size, sqes_size;
+} Ring;
+
+Ring io_ring = { .fd = -1 };
+pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+Task *io_head, *io_tail;         // submitted, not yet handed to the backend
+int io_wake = -1;                // eventfd the ring thread is woken through
+int io_stopping;
+pthread_t io_threads[IO_THREADS];
+char *io_scratch;
+uint64_t io_wake_count;          // target of the ring's eventfd read
+
+#define IO_WAKE_TAG 0            // user_data of the eventfd read
+
+int ring_setup(Ring *r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &p);
+    if (r->fd < 0) return 0;
+    if (!(p.features & IORING_FEAT_NODROP)) {
+        close(r->fd);            // too old to be trusted with a full ring
+        r->fd = -1;
+        return 0;
+    }
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq_ring = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ring = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        fprintf(stderr, "LAZY could not map its io_uring: %s\n", strerror(errno));
+        exit(1);
+    }
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 1;
+}
+
+void ring_destroy(Ring *r) {
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->cq_ring, r->cq_size);
+    munmap(r->sq_ring, r->sq_size);
+    close(r->fd);
+    r->fd = -1;
+}
+
+// Queue one read or write in the submission ring; only the ring thread calls
+// this, so the tail needs no lock
+void ring_push(Ring *r, int opcode, int fd, void *buf, unsigned len, uint64_t tag) {
+    unsigned tail = *r->sq_tail, index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->user_data = tag;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// A READ or WRITE's I/O is done: schedule its completion
+void io_finish(Task *task, long result) {
+    long due = task->started_at + *op_of(task)->duration, now = elapsed_us();
+    if (result < 0) {
+        errno = -result;
+        io_error(task->req.op == OP_READ ? "read" : "write", file_of(task));
+    }
+    io_release(file_of(task));
+    timer_add(&task->step, now > due ? now : due, EV_COMPLETE, task);
+    __atomic_sub_fetch(&task->timers, 1, __ATOMIC_SEQ_CST);    // the I/O, see start_request
+}
+
+// Whether `task`'s I/O goes through the asynchronous backend
+int io_async(Task *task) {
+    return IO_ASYNC && !task->joined_until && (task->req.op == OP_READ || task->req.op == OP_WRITE);
+}
+
+void io_submit(Task *task) {
+    io_acquire(file_of(task));   // open until io_finish
+    pthread_mutex_lock(&io_lock);
+    task->next_waiter = NULL;
+    if (io_tail) io_tail->next_waiter = task;
+    else io_head = task;
+    io_tail = task;
+    if (io_ring.fd < 0) {
+        pthread_cond_signal(&io_cond);
+    } else if (io_head == task) {
+        uint64_t one = 1;
+        if (write(io_wake, &one, sizeof(one)) != sizeof(one)) io_error("wake the ring for", file_of(task));
+    }
+    pthread_mutex_unlock(&io_lock);
+}
+
+// Up to `room` submissions off the list, in order
+Task *io_take(int room) {
+    Task *taken = io_head, *last = NULL, *t = io_head;
+    while (t && room-- > 0) {
+        last = t;
+        t = t->next_waiter;
+    }
+    if (!last) return NULL;
+    last->next_waiter = NULL;
+    io_head = t;
+    if (!t) io_tail = NULL;
+    return taken;
+}
+
+void *io_ring_main(void *arg) {
+    Ring *r = arg;
+    int in_flight = 0, to_submit = 1;
+    ring_push(r, IORING_OP_READ, io_wake, &io_wake_count, sizeof(io_wake_count), IO_WAKE_TAG);
+    while (1) {
+        // Everything waiting goes into the ring in one batch
+        pthread_mutex_lock(&io_lock);
+        Task *t = io_take(IO_RING_ENTRIES - 1 - in_flight);
+        int done = io_stopping && !io_head && in_flight == 0;
+        pthread_mutex_unlock(&io_lock);
+        if (done) break;
+        for (; t; t = t->next_waiter) {
+            File *file = file_of(t);
+            if (t->req.op == OP_READ) ring_push(r, IORING_OP_READ, file->fd, io_scratch, FILE_BYTES, (uint64_t)t);
+            else ring_push(r, IORING_OP_WRITE, file->fd, io_pattern, FILE_BYTES, (uint64_t)t);
+            in_flight++;
+            to_submit++;
         }
-    } else if (strcmp(req->operation, "DELETE") == 0) {
-        if (file->writers > 0 || file->readers > 0) {  
-            can_take_request = 0;
+        if (syscall(__NR_io_uring_enter, r->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            fprintf(stderr, "LAZY could not enter its io_uring: %s\n", strerror(errno));
+            exit(1);
         }
+        to_submit = 0;
+
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            if (cqe->user_data == IO_WAKE_TAG) {
+                ring_push(r, IORING_OP_READ, io_wake, &io_wake_count, sizeof(io_wake_count), IO_WAKE_TAG);
+                to_submit++;
+            } else {
+                io_finish((Task *)cqe->user_data, cqe->res);
+                in_flight--;
+            }
+            head++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
     }
-    
-    if (can_take_request) {
-        printf(PINK "LAZY has taken up the request of User %d at %d seconds\n" RESET, req->user_id, elapsed_time);
-        pthread_mutex_unlock(&file->lock);
-        break;
+    return NULL;
+}
+
+// Fallback backend: one blocking pread/pwrite per submission
+void *io_thread_main(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&io_lock);
+        while (!io_head && !io_stopping) pthread_cond_wait(&io_cond, &io_lock);
+        Task *t = io_take(1);
+        pthread_mutex_unlock(&io_lock);
+        if (!t) break;
+        File *file = file_of(t);
+        long result = t->req.op == OP_READ ? pread(file->fd, io_scratch, FILE_BYTES, 0)
+                                           : pwrite(file->fd, io_pattern, FILE_BYTES, 0);
+        io_finish(t, result < 0 ? -errno : result);
+    }
+    return NULL;
+}
+
+void io_async_start() {
+    int i;
+    io_scratch = malloc(FILE_BYTES);
+    if (ring_setup(&io_ring)) {
+        io_wake = eventfd(0, EFD_CLOEXEC);
+        pthread_create(&io_threads[0], NULL, io_ring_main, &io_ring);
     } else {
-        pthread_mutex_unlock(&file->lock);
+        for (i = 0; i < IO_THREADS; i++) pthread_create(&io_threads[i], NULL, io_thread_main, NULL);
     }
+}
+
+void io_async_stop() {
+    int i, ring = io_ring.fd >= 0;
+    pthread_mutex_lock(&io_lock);
+    io_stopping = 1;
+    pthread_cond_broadcast(&io_cond);
+    pthread_mutex_unlock(&io_lock);
+    if (ring) {
+        uint64_t one = 1;
+        if (write(io_wake, &one, sizeof(one)) != sizeof(one)) perror("LAZY could not stop its io_uring");
+    }
+    for (i = 0; i < (ring ? 1 : IO_THREADS); i++) pthread_join(io_threads[i], NULL);
+    if (ring) {
+        ring_destroy(&io_ring);
+        close(io_wake);
+    }
+    free(io_scratch);
+}
+
+// `task` is done with. It stays in the slot epoch until its last event has
+// run (event_done), as a patience event may still be queued and look at its
+// file, so this is safe under the file's lock.
+void request_finished(Task *task) {
+    if (USER_LIMITS) user_release(task);
+    if (__atomic_sub_fetch(&pending_requests, 1, __ATOMIC_ACQ_REL) == 0) {
+        // Signalled under the lock so the dispatcher cannot miss it
+        pthread_mutex_lock(&events.lock);
+        pthread_cond_signal(&events.cond);
+        pthread_mutex_unlock(&events.lock);
+        wake_shards();
+    }
+}
 
-    // Retry after 1 second
-    sleep(1);
+void decline_request(Task *task, long now) {
+    task->state = REQ_DECLINED;
+    log_event(LOG_DECLINE, task, now);
+    request_finished(task);
 }
 
-int elapsed_time = (int)(time(NULL) - start_time);
+void shed_request(Task *task, long now) {
+    task->state = REQ_SHED;
+    log_event(LOG_SHED, task, now);
+    request_finished(task);
+}
+
+void limit_request(Task *task, long now) {
+    task->state = REQ_LIMITED;
+    log_event(LOG_LIMIT, task, now);
+    request_finished(task);
+}
+
+void cancel_request(Task *task, long now) {
+    task->state = REQ_CANCELED;
+    log_event(LOG_CANCEL, task, now);
+    request_finished(task);
+}
 
-// Process operation
-File *file = &files[req->file_id - 1];
-pthread_mutex_lock(&file->lock);
+// Requests this thread took up, usually under a file's lock, whose I/O waits
+// until the event that took them up has let go of every lock
+__thread Task *io_started, *io_started_last;
 
-if (strcmp(req->operation, "READ") == 0) {
-    file->readers++;
-    if (file->readers == 1) {
-        sem_wait(&file->access_sem); // Lock access for writers when the first reader enters
+// Take up `task` at `now`; it already holds its admissions. I/O still to be
+// done counts as one of its events until its completion event is armed, so
+// nothing sees it without events, and frees it, in between.
+void start_request(Task *task, long now) {
+    task->state = REQ_ACTIVE;
+    log_event(LOG_START, task, now);
+    if (io_async(task)) {
+        __atomic_add_fetch(&task->timers, 1, __ATOMIC_SEQ_CST);
+        io_submit(task);
+    } else if (FILE_IO && !task->joined_until) {
+        __atomic_add_fetch(&task->timers, 1, __ATOMIC_SEQ_CST);
+        task->next_waiter = NULL;
+        if (io_started) io_started_last->next_waiter = task;
+        else io_started = task;
+        io_started_last = task;
+    } else {
+        timer_add(&task->step, run_operation(task, now), EV_COMPLETE, task);
     }
-    pthread_mutex_unlock(&file->lock);
+}
 
-    sleep(read_time); // Simulate read time
-    elapsed_time = (int)(time(NULL) - start_time);
-    printf(GREEN "The request for User %d was completed at %d seconds\n" RESET, req->user_id, elapsed_time);
+// Do the I/O of what the event just run took up, in the order it did so, so
+// that READs of one file taken up together read concurrently across workers
+// instead of one after another under the file's lock
+void io_run_started() {
+    while (io_started) {
+        Task *task = io_started;
+        io_started = task->next_waiter;
+        task->next_waiter = NULL;
+        timer_add(&task->step, run_operation(task, task->started_at), EV_COMPLETE, task);
+        __atomic_sub_fetch(&task->timers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void settle_waiter(File *file, Task *task, int state, long now) {
+    (void)file;
+    if (ENGINE == ENGINE_THREADS) {
+        settle_thread(task, state);
+    } else if (state == REQ_ACTIVE) {
+        // Armed first, so taking back the patience event never leaves it
+        // with none while another worker may be finishing an older one
+        start_request(task, now);
+        timer_cancel(&task->cancel, task);
+    } else if (state == REQ_DECLINED) {
+        decline_request(task, now);
+    } else {
+        cancel_request(task, now);
+    }
+}
+
+void attempt_multi(Task *task, long now) {
+    int outcome = multi_files_valid(task) ? admit_pair(task, now) : REQ_DECLINED;
+    if (outcome == REQ_ACTIVE) {
+        start_request(task, now);
+    } else if (outcome == REQ_DECLINED) {
+        decline_request(task, now);
+    } else {
+        timer_add(&task->step, multi_retry_at(task, now), EV_ATTEMPT, task);
+    }
+}
+
+void handle_attempt(Task *task, long now) {
+    if (now - task->req.request_time >= patience_time) {
+        cancel_request(task, now);
+        return;
+    }
+    slot_bind(task);
+    if (USER_LIMITS && !task->within_limits && !user_admit(task, now)) {
+        limit_request(task, now);
+        return;
+    }
+    if (task->req.op == OP_CREATE) {
+        if (slot_create(task, now) == REQ_ACTIVE) start_request(task, now);
+        else decline_request(task, now);
+        return;
+    }
+    File *file = file_of(task);
+    if (!file || !op_of(task)->valid) {
+        decline_request(task, now);
+        return;
+    }
+    if (op_of(task)->num_files > 1) {
+        attempt_multi(task, now);
+        return;
+    }
 
     pthread_mutex_lock(&file->lock);
-    file->readers--;
-    if (file->readers == 0) {
-        sem_post(&file->access_sem); // Unlock access for writers when the last reader exits
+    if (!file->exists) {
+        decline_request(task, now);          // a tombstone
+    } else if (admit_try(file, task, now)) {
+        start_request(task, now);
+    } else if (LOAD_SHEDDING && admit_hopeless(file, task, now)) {
+        shed_request(task, now);
+    } else {
+        admit_enqueue(file, task, now);
+        timer_add(&task->cancel, task->req.request_time + patience_time, EV_CANCEL, task);
     }
     pthread_mutex_unlock(&file->lock);
-} 
-else if (strcmp(req->operation, "WRITE") == 0) {
-    sem_wait(&file->access_sem);
-    file->writers++;
-    pthread_mutex_unlock(&file->lock);
+}
+
+void handle_complete(Task *task, long now) {
+    log_event(LOG_COMPLETE, task, now);
+
+    int i;
+    task->state = REQ_DONE;
+    for (i = 0; i < op_of(task)->num_files; i++) {
+        File *file = file_at(task, i);
+        pthread_mutex_lock(&file->lock);
+        admit_release(file, task, now);
+        pthread_mutex_unlock(&file->lock);
+    }
 
-    sleep(write_time); // Simulate write time
-    elapsed_time = (int)(time(NULL) - start_time);
-    printf(GREEN "The request for User %d was completed at %d seconds\n" RESET, req->user_id, elapsed_time);
+    request_finished(task);
+}
 
+void handle_cancel(Task *task, long now) {
+    File *file = file_of(task);
     pthread_mutex_lock(&file->lock);
-    file->writers--;
-    pthread_mutex_unlock(&file->lock);
-    sem_post(&file->access_sem);
-} 
-else if (strcmp(req->operation, "DELETE") == 0) {
-    file->exists = 0;
+    if (task->state == REQ_WAITING) {
+        admit_unlink(file, task, now);
+        cancel_request(task, now);
+    }
     pthread_mutex_unlock(&file->lock);
+}
+
+// With NUM_SHARDS a finished task goes back to its shard's own free list, so
+// shards do not contend on the arena lock. Only the ingesting thread
+// allocates: it takes a shard's whole list at once when it has used up what
+// it took last time, which leaves no ABA window.
+Task *task_alloc(Request *req) {
+    if (NUM_SHARDS > 0) {
+        EventQueue *q = &shards[req->file_id % (NUM_SHARDS > 0 ? NUM_SHARDS : 1)];
+        if (!q->reused_tasks) q->reused_tasks = __atomic_exchange_n(&q->freed_tasks, NULL, __ATOMIC_ACQUIRE);
+        Task *task = q->reused_tasks;
+        if (task) {
+            q->reused_tasks = *(void **)task;
+            memset(task, 0, sizeof(Task));
+            return task;
+        }
+    }
+    return arena_alloc(&tasks);
+}
 
-    sleep(delete_time); // Simulate delete time
-    elapsed_time = (int)(time(NULL) - start_time);
-    printf(GREEN "The request for User %d was completed at %d seconds\n" RESET, req->user_id, elapsed_time);
+void task_free(Task *task) {
+    if (NUM_SHARDS == 0) {
+        arena_free(&tasks, task);
+        return;
+    }
+    EventQueue *q = queue_of(task);
+    void *head = __atomic_load_n(&q->freed_tasks, __ATOMIC_RELAXED);
+    do {
+        *(void **)task = head;
+    } while (!__atomic_compare_exchange_n(&q->freed_tasks, &head, task, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
-pthread_exit(NULL);
+// Start tracking a parsed request and schedule its arrival
+void ingest(Request *req) {
+    Task *task = task_alloc(req);
+    task->req = *req;
+    task->seq = num_parsed++;
+    __atomic_add_fetch(&pending_requests, 1, __ATOMIC_RELAXED);
+    if (STREAM_INPUT) {
+        pthread_mutex_lock(&ingest_lock);
+        ingest_window++;
+        ingest_watermark = task->req.request_time;
+        pthread_mutex_unlock(&ingest_lock);
+    }
+    task->state = REQ_NEW;
+    timer_add(&task->step, task->req.request_time, EV_ARRIVE, task);
+}
 
+void ingest_finish() {
+    pthread_mutex_lock(&events.lock);
+    __atomic_store_n(&ingest_done, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&events.cond);
+    wake_shards();
+    pthread_mutex_unlock(&events.lock);
 }
 
-int main() {
-    int i;
-    scanf("%d %d %d", &read_time, &write_time, &delete_time);
-    scanf("%d %d %d", &num_files, &max_concurrent_access, &patience_time);
+// Real-time streaming: parse ahead of the clock, blocking while the window is full
+void *reader_main(void *arg) {
+    (void)arg;
+    Request req;
+    while (1) {
+        pthread_mutex_lock(&ingest_lock);
+        while (ingest_window >= INGEST_WINDOW) {
+            pthread_cond_wait(&ingest_cond, &ingest_lock);
+        }
+        pthread_mutex_unlock(&ingest_lock);
+        if (!parse_request(&req)) break;
+        ingest(&req);
+    }
+    ingest_finish();
+    return NULL;
+}
 
-    // Initialize files
-    for (i = 0; i < num_files; i++) {
-        files[i].id = i + 1;
-        files[i].exists = 1;
-        files[i].readers = 0;
-        files[i].writers = 0;
-        pthread_mutex_init(&files[i].lock, NULL);
-        sem_init(&files[i].access_sem, 0, max_concurrent_access);  // Initialize semaphore for concurrent access
+// Recycle a request, and let go of its files' slots, once it has finished and
+// none of its events remain
+void event_done(Task *task) {
+    if (__atomic_sub_fetch(&task->timers, 1, __ATOMIC_SEQ_CST) == 0 &&
+        task->state != REQ_NEW && task->state != REQ_WAITING && task->state != REQ_ACTIVE) {
+        slot_unbind(task);
+        task_free(task);
+    }
+}
+
+void handle_arrive(Task *task, long now) {
+    if (STREAM_INPUT) {
+        pthread_mutex_lock(&ingest_lock);
+        if (ingest_window-- == INGEST_WINDOW) pthread_cond_signal(&ingest_cond);
+        pthread_mutex_unlock(&ingest_lock);
+    }
+    log_event(LOG_REQUEST, task, task->req.request_time);
+    timer_add(&task->step, now + seconds_to_us(RESPONSE_DELAY), EV_ATTEMPT, task);
+}
+
+// What each event does to its request
+void (*event_handlers[NUM_EVENTS])(Task *task, long now) = {
+    handle_arrive, handle_attempt, handle_complete, handle_cancel
+};
+
+void run_event(Timer *t) {
+    Task *task = t->task;
+    event_handlers[t->event](task, t->expires);
+    if (FILE_IO) io_run_started();
+    event_done(task);
+}
+
+void *worker_main(void *arg) {
+    (void)arg;
+    Timer *t;
+    while ((t = job_pop()) != NULL) {
+        run_event(t);
     }
+    return NULL;
+}
 
-    // Read requests
+void *steal_worker_main(void *arg) {
+    long self = (long)arg;
+    unsigned int seed = (unsigned int)self + 1;
     while (1) {
-        Request req;
-        char temp[100];
-        scanf("%s", temp);
-        if (strcmp(temp, "STOP") == 0) break;
-        req.user_id = atoi(temp);
-        scanf("%d %s %d", &req.file_id, req.operation, &req.request_time);
-        requests[num_requests++] = req;
+        Timer *t = deque_steal(&deques[self]);
+        int i;
+        for (i = 0; i < 2 * NUM_WORKERS && (t == NULL || t == STEAL_RETRY); i++) {
+            t = deque_steal(&deques[rand_r(&seed) % NUM_WORKERS]);
+        }
+        if (t == STEAL_RETRY) continue;
+        if (t) {
+            run_event(t);
+            continue;
+        }
+
+        pthread_mutex_lock(&park_lock);
+        __atomic_add_fetch(&parked, 1, __ATOMIC_SEQ_CST);
+        while (!steal_shutdown && deques_empty()) {
+            pthread_cond_wait(&park_cond, &park_lock);
+        }
+        __atomic_sub_fetch(&parked, 1, __ATOMIC_SEQ_CST);
+        int done = steal_shutdown && deques_empty();
+        pthread_mutex_unlock(&park_lock);
+        if (done) break;
     }
+    return NULL;
+}
 
-    // Record start time and print wake-up message
-    start_time = time(NULL);
-    printf("LAZY has woken up!\n");
+// Whether the earliest event may run before more input is parsed: nothing
+// still unread can arrive before it (input is sorted by request time)
+int event_ready() {
+    if (ingest_done) return 1;
+    Timer *top = event_peek(&events);
+    if (!top) return 0;
+    return top->expires < ingest_watermark || top->event == EV_ARRIVE;
+}
+
+// Simulated time: run events one at a time, in order, on the calling thread,
+// parsing streamed input only as far as the clock needs it
+void run_virtual() {
+    while (1) {
+        if (!event_ready()) {
+            Request req;
+            if (parse_request(&req)) ingest(&req);
+            else ingest_finish();
+            continue;
+        }
+        if (!event_peek(&events) || dispatch_finished()) break;
+        run_event(event_pop(&events));
+    }
+}
+
+// Real time: release each event to the workers once the monotonic clock
+// reaches it, sleeping in between
+void run_realtime() {
+    int i;
+    pthread_t workers[NUM_WORKERS];
+
+    for (i = 0; i < NUM_WORKERS; i++) {
+        pthread_create(&workers[i], NULL, EXECUTOR == EXECUTOR_STEALING ? steal_worker_main : worker_main,
+                       (void *)(long)i);
+    }
+
+    pthread_mutex_lock(&events.lock);
+    while (!dispatch_finished()) {
+        Timer *t = event_peek(&events);
+        if (!t) {
+            pthread_cond_wait(&events.cond, &events.lock);
+            continue;
+        }
+        long due_at = t->expires;
+        struct timespec due = timespec_after(start_time, due_at);
+        if (pthread_cond_timedwait(&events.cond, &events.lock, &due) != ETIMEDOUT) {
+            continue;
+        }
+        while ((t = event_peek(&events)) && t->expires <= due_at) {
+            event_pop(&events);
+            if (EXECUTOR == EXECUTOR_STEALING) {
+                steal_submit(t);
+                continue;
+            }
+            // A completion holding up a more urgent request goes first
+            int urgent = PRIORITIES && t->event == EV_COMPLETE && admit_inherits(t->task);
+            if (job_push(t, urgent)) __atomic_add_fetch(&stats.boosted, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&events.lock);
+
+    if (EXECUTOR == EXECUTOR_STEALING) {
+        steal_finish();
+    } else {
+        pthread_mutex_lock(&jobs.lock);
+        jobs.shutdown = 1;
+        pthread_cond_broadcast(&jobs.cond);
+        pthread_mutex_unlock(&jobs.lock);
+    }
+    for (i = 0; i < NUM_WORKERS; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    deques_destroy();
+}
+
+// One shard: its thread, pinned to a CPU, waits for the shard's next event and
+// runs it inline. Files are routed to shards by id, so a shard's requests and
+// file locks are normally touched by that thread alone.
+void *shard_main(void *arg) {
+    EventQueue *q = arg;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET((q - shards) % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    pthread_mutex_lock(&q->lock);
+    while (!dispatch_finished()) {
+        Timer *t = event_peek(q);
+        if (!t) {
+            pthread_cond_wait(&q->cond, &q->lock);
+            continue;
+        }
+        long due_at = t->expires;
+        struct timespec due = timespec_after(start_time, due_at);
+        if (pthread_cond_timedwait(&q->cond, &q->lock, &due) != ETIMEDOUT) {
+            continue;
+        }
+        while ((t = event_peek(q)) && t->expires <= due_at) {
+            event_pop(q);
+            pthread_mutex_unlock(&q->lock);
+            run_event(t);
+            pthread_mutex_lock(&q->lock);
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+void run_sharded() {
+    int i;
+    pthread_t threads[NUM_SHARDS > 0 ? NUM_SHARDS : 1];
+    for (i = 0; i < NUM_SHARDS; i++) {
+        pthread_create(&threads[i], NULL, shard_main, &shards[i]);
+    }
+    for (i = 0; i < NUM_SHARDS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void event_queue_init(EventQueue *q) {
+    pthread_condattr_t attr;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&q->cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
 
+void event_queue_destroy(EventQueue *q) {
+    free(q->heap);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+}
+
+void run_dispatcher() {
+    long i;
+    pthread_t reader;
+
+    event_queue_init(&events);
+    for (i = 0; i < NUM_SHARDS; i++) {
+        event_queue_init(&shards[i]);
+    }
+    pthread_mutex_init(&jobs.lock, NULL);
+    pthread_cond_init(&jobs.cond, NULL);
+
+    for (i = 0; i < requests.count && !STREAM_INPUT; i++) {
+        ingest(arena_at(&requests, i));
+    }
+
+    if (VIRTUAL_CLOCK) {
+        run_virtual();
+    } else {
+        if (STREAM_INPUT) pthread_create(&reader, NULL, reader_main, NULL);
+        if (IO_ASYNC) io_async_start();
+        if (NUM_SHARDS > 0) run_sharded();
+        else run_realtime();
+        if (IO_ASYNC) io_async_stop();
+        if (STREAM_INPUT) pthread_join(reader, NULL);
+    }
+
+    event_queue_destroy(&events);
+    for (i = 0; i < NUM_SHARDS; i++) {
+        event_queue_destroy(&shards[i]);
+    }
+    pthread_mutex_destroy(&jobs.lock);
+    pthread_cond_destroy(&jobs.cond);
+}
+
+void run_threads() {
+    long i;
     // Create threads to handle each request
-    pthread_t threads[MAX_USERS];
-    for (i = 0; i < num_requests; i++) {
-        pthread_create(&threads[i], NULL, process_request, (void *)&requests[i]);
+    pthread_t *threads = malloc(requests.count * sizeof(pthread_t));
+    for (i = 0; i < requests.count; i++) {
+        pthread_create(&threads[i], NULL, process_request, (void *)i);
     }
 
     // Wait for all threads to complete
-    for (i = 0; i < num_requests; i++) {
+    for (i = 0; i < requests.count; i++) {
         pthread_join(threads[i], NULL);
     }
+    free(threads);
+}
+
+int main() {
+    long i;
+    read_time = seconds_to_us(read_number());
+    write_time = seconds_to_us(read_number());
+    delete_time = seconds_to_us(read_number());
+    num_files = (int)read_number();
+    max_concurrent_access = (int)read_number();
+    patience_time = seconds_to_us(read_number());
+    copy_time = read_time + write_time;
+    move_time = copy_time + delete_time;
+
+    // Initialize files
+    if (num_files < 0) num_files = 0;
+    file_ids = calloc(num_files + 1, sizeof(FileEntry));
+    if (!file_ids) {
+        fprintf(stderr, "Out of memory for %d files\n", num_files);
+        return 1;
+    }
+    for (i = 0; i < num_files; i++) {
+        file_ids[i].id = i + 1;
+        file_ids[i].slot = slot_new(i + 1, 0);
+    }
+    if (FILE_IO) io_init();
+    users_init();
+
+    // Read requests, unless the dispatcher streams them in while running
+    Request req;
+    while (!STREAM_INPUT && parse_request(&req)) {
+        *(Request *)arena_alloc(&requests) = req;
+    }
+
+    // Record start time and print wake-up message
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    printf("LAZY has woken up!\n");
+    log_start();
+
+    if (ENGINE == ENGINE_THREADS) {
+        run_threads();
+    } else {
+        run_dispatcher();
+    }
+    log_stop();
 
     printf("LAZY has no more pending requests and is going back to sleep!\n");
 
+    fflush(stdout);              // the summary on stderr comes after the log
+    if (SHOW_STATS) print_stats();
+    if (SHOW_ADMISSION_STATS) {
+        for (i = 0; i < num_files; i++) {
+            if (!file_ids[i].slot) continue;         // deleted: its slot went with it
+            Admission *adm = &file_ids[i].slot->adm;
+            fprintf(stderr, "File %d: admitted %ld, queued %ld, max queue depth %d, avg wait %.6f s, max wait %.6f s\n",
+                    file_ids[i].id, adm->admitted, adm->waited, adm->max_depth,
+                    adm->waited ? (double)adm->total_wait / adm->waited / USEC_PER_SEC : 0.0,
+                    (double)adm->max_wait / USEC_PER_SEC);
+        }
+    }
+
     // Cleanup
+    if (FILE_IO) io_destroy();
     for (i = 0; i < num_files; i++) {
-        pthread_mutex_destroy(&files[i].lock);
-        sem_destroy(&files[i].access_sem);  
+        if (file_ids[i].slot) slot_free(file_ids[i].slot);
     }
+    epoch_destroy(&slot_epochs);
+    epoch_destroy(&version_epochs);
+    free(file_ids);
+    arena_destroy(&requests);
+    arena_destroy(&tasks);
+    arena_destroy(&file_slots);
+    arena_destroy(&versions);
+    users_destroy();
 
     return 0;
 }
@@ -0,0 +1,72 @@
+#!/bin/sh
+# Benchmark harness for LAZY (1.c). Generates a trace with lazygen, replays it
+# on the simulated clock and/or in real time, and appends one line per run to
+# a tab-separated results file so runs of different commits can be compared.
+#
+#   ./bench.sh [-o results.tsv] [-M "virtual realtime"] [-- lazygen options]
+#
+# Extra LAZY knobs go in LAZY_CFLAGS, e.g. LAZY_CFLAGS=-DQUEUE_POLICY=1.
+set -e
+
+cd "$(dirname "$0")"
+results=bench_results.tsv
+modes=virtual
+while getopts "o:M:" opt; do
+    case $opt in
+    o) results=$OPTARG ;;
+    M) modes=$OPTARG ;;
+    *) sed -n '2,9p' "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+gcc -O2 lazygen.c -o "$work/lazygen" -lm
+"$work/lazygen" "$@" > "$work/trace.txt"
+
+# One field of the summary JSON: a top-level total, or one from `section`
+field() {
+    json=$1 section=$2 name=$3
+    if [ -n "$section" ]; then
+        json=$(printf '%s' "$json" | sed "s/.*\"$section\":{\([^}]*\)}.*/\1/")
+    else
+        json=$(printf '%s' "$json" | sed 's/"wait":.*//')
+    fi
+    printf '%s' "$json" | sed "s/.*\"$name\":\([0-9.]*\).*/\1/"
+}
+
+if [ ! -f "$results" ]; then
+    printf 'date\tcommit\tmode\tcflags\ttrace\trequests\tcompleted\tcanceled\tdeclined\tops_per_sec\tcancel_rate\tp50\tp90\tp99\tmax\twall\n' > "$results"
+fi
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+for mode in $modes; do
+    case $mode in
+    virtual) clock=-DVIRTUAL_CLOCK=1 ;;
+    realtime) clock= ;;
+    *) echo "unknown mode $mode" >&2; exit 1 ;;
+    esac
+    # shellcheck disable=SC2086
+    gcc -O2 $clock -DSTATS_JSON=1 -DLOG_COLOR=0 $LAZY_CFLAGS 1.c -o "$work/lazy" -lpthread
+
+    start=$(date +%s.%N)
+    "$work/lazy" < "$work/trace.txt" > /dev/null 2> "$work/stats.json"
+    end=$(date +%s.%N)
+    json=$(tail -n 1 "$work/stats.json")
+
+    requests=$(field "$json" "" requests)
+    completed=$(field "$json" "" completed)
+    canceled=$(field "$json" "" canceled)
+    declined=$(field "$json" "" declined)
+    duration=$(field "$json" "" duration)
+    printf '%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n' \
+        "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$commit" "$mode" "$LAZY_CFLAGS" "$*" \
+        "$requests" "$completed" "$canceled" "$declined" \
+        "$(echo "$completed $duration" | awk '{ printf "%.3f", ($2 > 0 ? $1 / $2 : 0) }')" \
+        "$(echo "$canceled $requests" | awk '{ printf "%.4f", ($2 > 0 ? $1 / $2 : 0) }')" \
+        "$(field "$json" response p50)" "$(field "$json" response p90)" \
+        "$(field "$json" response p99)" "$(field "$json" response max)" \
+        "$(echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }')" | tee -a "$results"
+done
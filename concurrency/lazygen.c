@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+// Synthetic trace generator for LAZY (1.c). Writes a header and requests
+// sorted by request time, ending with STOP. Build with
+// `gcc lazygen.c -o lazygen -lm`; see usage() for the knobs.
+
+enum { GEN_READ, GEN_WRITE, GEN_DELETE, GEN_COPY, GEN_MOVE, GEN_CREATE, GEN_OPS };
+
+const char *gen_op_names[GEN_OPS] = { "READ", "WRITE", "DELETE", "COPY", "MOVE", "CREATE" };
+
+typedef struct {
+    long requests;
+    int files;
+    int users;
+    double zipf;                 // file popularity exponent, 0 = uniform
+    double mix[GEN_OPS];         // relative weights
+    double rate;                 // mean arrivals per second
+    int bursty;                  // 0 = Poisson, 1 = on/off bursts
+    double burst;                // mean requests per burst
+    double read_time, write_time, delete_time;
+    int max_concurrent;
+    double patience;
+    int priorities;              // priority classes per request, 0 = no field
+    unsigned long seed;
+} GenConfig;
+
+unsigned long rng_state;
+
+// xorshift64*, uniform in (0, 1)
+double uniform() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 2685821657736338717UL) >> 11) * (1.0 / 9007199254740992.0) + 1e-18;
+}
+
+double exponential(double mean) {
+    return -mean * log(uniform());
+}
+
+// Cumulative Zipf weights over files 1..n, so a draw is a binary search
+double *zipf_table(int n, double s) {
+    double *cdf = malloc(n * sizeof(double));
+    double sum = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, s);
+        cdf[i] = sum;
+    }
+    for (i = 0; i < n; i++) cdf[i] /= sum;
+    return cdf;
+}
+
+int zipf_draw(double *cdf, int n) {
+    double u = uniform();
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo + 1;
+}
+
+int op_draw(double *mix) {
+    double total = 0, u;
+    int op;
+    for (op = 0; op < GEN_OPS; op++) total += mix[op];
+    u = uniform() * total;
+    for (op = 0; op < GEN_OPS - 1; op++) {
+        if (u < mix[op]) return op;
+        u -= mix[op];
+    }
+    return op;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options] > trace.txt\n"
+            "  -n requests      number of requests (10000)\n"
+            "  -f files         number of files (100)\n"
+            "  -u users         number of users (50)\n"
+            "  -z s             Zipf exponent of file popularity, 0 = uniform (1.0)\n"
+            "  -m r:w:d[:c:m:n] READ:WRITE:DELETE[:COPY:MOVE:CREATE] weights (80:19:1)\n"
+            "  -r rate          mean arrivals per second (20)\n"
+            "  -a poisson|bursty arrival process (poisson)\n"
+            "  -b size          mean requests per burst when bursty (20)\n"
+            "  -t r,w,d         READ,WRITE,DELETE seconds (1,2,0.5)\n"
+            "  -c max           max concurrent access per file (4)\n"
+            "  -p patience      seconds (5)\n"
+            "  -P classes       add a uniform priority 0..classes-1 (for PRIORITIES=1)\n"
+            "  -s seed          random seed (1)\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    GenConfig cfg = {
+        10000, 100, 50, 1.0, { 80, 19, 1, 0, 0, 0 }, 20, 0, 20, 1, 2, 0.5, 4, 5, 0, 1
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "n:f:u:z:m:r:a:b:t:c:p:P:s:h")) != -1) {
+        switch (opt) {
+        case 'n': cfg.requests = atol(optarg); break;
+        case 'f': cfg.files = atoi(optarg); break;
+        case 'u': cfg.users = atoi(optarg); break;
+        case 'z': cfg.zipf = atof(optarg); break;
+        case 'm':
+            memset(cfg.mix, 0, sizeof(cfg.mix));
+            sscanf(optarg, "%lf:%lf:%lf:%lf:%lf:%lf", &cfg.mix[0], &cfg.mix[1], &cfg.mix[2], &cfg.mix[3], &cfg.mix[4],
+                   &cfg.mix[5]);
+            break;
+        case 'r': cfg.rate = atof(optarg); break;
+        case 'a': cfg.bursty = strcmp(optarg, "bursty") == 0; break;
+        case 'b': cfg.burst = atof(optarg); break;
+        case 't': sscanf(optarg, "%lf,%lf,%lf", &cfg.read_time, &cfg.write_time, &cfg.delete_time); break;
+        case 'c': cfg.max_concurrent = atoi(optarg); break;
+        case 'p': cfg.patience = atof(optarg); break;
+        case 'P': cfg.priorities = atoi(optarg); break;
+        case 's': cfg.seed = strtoul(optarg, NULL, 10); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (cfg.files < 1 || cfg.users < 1 || cfg.rate <= 0 || cfg.burst < 1 || cfg.priorities < 0 ||
+        cfg.priorities > 256) usage(argv[0]);
+    if (cfg.files < 2) cfg.mix[GEN_COPY] = cfg.mix[GEN_MOVE] = 0;
+    rng_state = cfg.seed * 0x9e3779b97f4a7c15UL + 1;
+
+    double *cdf = zipf_table(cfg.files, cfg.zipf);
+    printf("%g %g %g %d %d %g\n", cfg.read_time, cfg.write_time, cfg.delete_time,
+           cfg.files, cfg.max_concurrent, cfg.patience);
+
+    // Bursty: bursts of about `burst` requests, spaced ten times tighter than
+    // the mean inside a burst, with the idle gaps making up the rest so the
+    // long-run rate is kept
+    double t = 0;
+    long left_in_burst = 0, i;
+    for (i = 0; i < cfg.requests; i++) {
+        if (!cfg.bursty) {
+            t += exponential(1 / cfg.rate);
+        } else if (left_in_burst > 0) {
+            left_in_burst--;
+            t += exponential(0.1 / cfg.rate);
+        } else {
+            left_in_burst = (long)exponential(cfg.burst);
+            t += exponential(0.9 * cfg.burst / cfg.rate);
+        }
+
+        int user = 1 + (int)(uniform() * cfg.users);
+        int op = op_draw(cfg.mix);
+        int file = zipf_draw(cdf, cfg.files);
+        if (op == GEN_COPY || op == GEN_MOVE) {
+            int dst;
+            do dst = zipf_draw(cdf, cfg.files); while (dst == file);
+            printf("%d %d %s %d %.3f", user, file, gen_op_names[op], dst, t);
+        } else {
+            printf("%d %d %s %.3f", user, file, gen_op_names[op], t);
+        }
+        if (cfg.priorities > 0) printf(" %d", (int)(uniform() * cfg.priorities));
+        putchar('\n');
+    }
+    printf("STOP\n");
+    free(cdf);
+    return 0;
+}